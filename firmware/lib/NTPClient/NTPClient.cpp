@@ -120,6 +120,10 @@ bool NTPClient::forceUpdate() {
   unsigned long secsSince1900 = highWord << 16 | lowWord;
 
   this->_currentEpoc = secsSince1900 - SEVENZYYEARS;
+  // fraction of the second, in units of 2^-32 s
+  unsigned long fraction = (unsigned long)this->_packetBuffer[44] << 24 | (unsigned long)this->_packetBuffer[45] << 16 |
+                           (unsigned long)this->_packetBuffer[46] << 8 | this->_packetBuffer[47];
+  this->_currentMillis = ((unsigned long long)fraction * 1000) >> 32;
 
   return true;
 }
@@ -136,7 +140,13 @@ bool NTPClient::update() {
 unsigned long NTPClient::getEpochTime() {
   return this->_timeOffset + // User offset
          this->_currentEpoc + // Epoc returned by the NTP server
-         ((millis() - this->_lastUpdate) / 1000); // Time since last update
+         ((this->_currentMillis + millis() - this->_lastUpdate) / 1000); // Time since last update (and the fraction)
+}
+
+unsigned long long NTPClient::getEpochMillis() {
+  return (unsigned long long)(this->_timeOffset + this->_currentEpoc) * 1000 + // Epoc returned by the NTP server
+         this->_currentMillis +
+         (millis() - this->_lastUpdate); // Time since last update
 }
 
 int NTPClient::getDay() {
@@ -231,4 +241,5 @@ void NTPClient::sendNTPPacket() {
 
 void NTPClient::setEpochTime(unsigned long secs) {
   this->_currentEpoc = secs;
+  this->_currentMillis = 0;
 }
@@ -22,6 +22,7 @@ class NTPClient {
     unsigned long _updateInterval = 60000;  // In ms
 
     unsigned long _currentEpoc    = 0;      // In s
+    unsigned long _currentMillis  = 0;      // In ms, fraction of the second in _currentEpoc
     unsigned long _lastUpdate     = 0;      // In ms
 
     byte          _packetBuffer[NTP_PACKET_SIZE];
@@ -86,6 +87,11 @@ class NTPClient {
      * @return time in seconds since Jan. 1, 1970
      */
     unsigned long getEpochTime();
+
+    /**
+     * @return time in milliseconds since Jan. 1, 1970, including the fraction of the second sent by the NTP server
+     */
+    unsigned long long getEpochMillis();
   
     /**
     * @return secs argument (or 0 for current date) formatted to ISO 8601
@@ -0,0 +1,31 @@
+#pragma once
+
+// European Air Quality Index (EEA): 1 Good, 2 Fair, 3 Moderate, 4 Poor, 5 Very poor, 6 Extremely poor.
+// PM2.5 and PM10 are rated from their 24 hour running means, NO2 and SO2 from their hourly means, all in µg/m³.
+// The index is the worst level of the pollutants that are available. Has no Arduino dependencies.
+
+#include <stdint.h>
+
+enum AqiPollutant : uint8_t {
+  AQI_PM2_5,
+  AQI_PM10,
+  AQI_NO2,
+  AQI_SO2,
+  AQI_POLLUTANT_COUNT
+};
+
+// Upper bounds of levels 1-5, anything above the last one is level 6
+const float aqiBands[AQI_POLLUTANT_COUNT][5] = {
+  { 10,  20,  25,  50,  75  }, // PM2.5
+  { 20,  40,  50,  100, 150 }, // PM10
+  { 40,  90,  120, 230, 340 }, // NO2
+  { 100, 200, 350, 500, 750 }, // SO2
+};
+
+inline uint8_t aqiLevel(AqiPollutant pollutant, float concentration) {
+  uint8_t level = 1;
+  while (level < 6 && concentration > aqiBands[pollutant][level - 1]) {
+    level++;
+  }
+  return level;
+}
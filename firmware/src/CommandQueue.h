@@ -0,0 +1,51 @@
+#pragma once
+
+// Bounded priority queue of up to N items: the highest priority comes out first, and items of the same priority come out
+// in the order they were pushed. Kept sorted on push, which is cheap for the few items it's meant for.
+// Has no Arduino dependencies.
+
+#include <stddef.h>
+#include <stdint.h>
+
+template <typename T, size_t N>
+class CommandQueue {
+  public:
+    CommandQueue() : _count(0) {}
+
+    // False if the queue is full
+    bool push(const T &item, uint8_t priority) {
+      if (_count == N) {
+        return false;
+      }
+      size_t i = _count++;
+      for (; i > 0 && _priorities[i - 1] < priority; i--) {
+        _items[i]      = _items[i - 1];
+        _priorities[i] = _priorities[i - 1];
+      }
+      _items[i]      = item;
+      _priorities[i] = priority;
+      return true;
+    }
+
+    bool pop(T &item) {
+      if (!_count) {
+        return false;
+      }
+      item = _items[0];
+      _count--;
+      for (size_t i = 0; i < _count; i++) {
+        _items[i]      = _items[i + 1];
+        _priorities[i] = _priorities[i + 1];
+      }
+      return true;
+    }
+
+    size_t count() const {
+      return _count;
+    }
+
+  private:
+    T       _items[N];
+    uint8_t _priorities[N];
+    size_t  _count;
+};
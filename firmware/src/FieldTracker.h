@@ -0,0 +1,62 @@
+#pragma once
+
+// Remembers a hash of the last sent value of up to N named fields, to tell which of them changed since.
+// update() is called with every field of a message, commit() once the message was sent (otherwise the changes are
+// reported again next time). Fields that don't fit are always reported as changed. Has no Arduino dependencies.
+
+#include <stddef.h>
+#include <stdint.h>
+
+template <size_t N>
+class FieldTracker {
+  public:
+    FieldTracker() : _count(0) {}
+
+    // Records the field's current value (as text), true if it's new or differs from the last committed one
+    bool update(const char* name, const char* value) {
+      uint32_t key  = hash(name);
+      uint32_t text = hash(value);
+      for (size_t i = 0; i < _count; i++) {
+        if (_key[i] == key) {
+          _pending[i] = text;
+          return !_sent[i] || _value[i] != text;
+        }
+      }
+      if (_count < N) {
+        _key[_count]     = key;
+        _value[_count]   = 0;
+        _sent[_count]    = false;
+        _pending[_count] = text;
+        _count++;
+      }
+      return true;
+    }
+
+    // The values passed to update() since the last commit were sent
+    void commit() {
+      for (size_t i = 0; i < _count; i++) {
+        _value[i] = _pending[i];
+        _sent[i]  = true;
+      }
+    }
+
+    size_t count() const {
+      return _count;
+    }
+
+  private:
+    // FNV-1a
+    static uint32_t hash(const char* text) {
+      uint32_t value = 2166136261u;
+      while (*text) {
+        value = (value ^ (uint8_t)*text++) * 16777619u;
+      }
+      return value;
+    }
+
+    size_t   _count;
+    uint32_t _key[N];
+    uint32_t _value[N];   // Last committed
+    uint32_t _pending[N]; // From the last update()
+    bool     _sent[N];
+};
@@ -0,0 +1,38 @@
+#pragma once
+
+// Fixed-point PPB to µg/m³ conversion for the SPEC Sensors DGS modules.
+// Results are rounded tenths of µg/m³, so averaging doesn't accumulate the error of truncating every sample to whole µg/m³.
+// Has no Arduino dependencies so it can be compiled on the host.
+//
+// µg/m³ = PPB * M * P / (R * T) / 1000, where M is the molar mass [g/mol], P the pressure [Pa] and T the temperature [K].
+// Against a double precision evaluation of the same formula the result is off by less than 0.51 tenths (i.e. rounding only)
+// over the whole sensor range (-2000..50000 PPB, -40..85 °C, 30..110 kPa).
+
+#include <stdint.h>
+
+#define GAS_STANDARD_PRESSURE     101325 // [Pa]
+#define GAS_REFERENCE_TEMPERATURE 200    // [0.1 °C] EU reference conditions for reporting gases are 20 °C and 101.325 kPa
+
+// M / R in Q24, per gas and computed at compile time (e.g. gasCoefficient(64.0638) for SO2)
+constexpr int32_t gasCoefficient(double molarMass) {
+  return (int32_t)(molarMass / 8.314462618 * 16777216.0 + 0.5);
+}
+
+// 'temperature' in tenths of °C, 'pressure' in Pa. Returns tenths of µg/m³.
+inline int32_t gasPpbToUgm3(int32_t ppb, int32_t coefficient, int32_t temperature, int32_t pressure) {
+  int64_t numerator   = (int64_t)ppb * coefficient * pressure;        // < 2^60 for the ranges above
+  int64_t denominator = ((int64_t)temperature * 10 + 27315) << 24;    // Hundredths of K, Q24
+  int64_t half        = denominator / 2;
+  return (int32_t)((numerator >= 0 ? numerator + half : numerator - half) / denominator);
+}
+
+// Rounds tenths to whole units (half away from zero)
+inline int32_t gasRoundTenths(int32_t tenths) {
+  return (tenths >= 0 ? tenths + 5 : tenths - 5) / 10;
+}
+
+// Temperature in tenths of °C from the sensor's raw temperature reading (T = -45 + 175 * ADC_T / 65536).
+// The data line only has the temperature in whole °C, the raw reading gives it at a finer resolution.
+inline int32_t gasTemperatureFromDigital(int32_t temperatureDigital) {
+  return (1750 * temperatureDigital - 450 * 65536 + 32768) >> 16;
+}
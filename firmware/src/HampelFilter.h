@@ -0,0 +1,124 @@
+#pragma once
+
+// Streaming outlier rejection (Hampel identifier) for a fixed set of measurement channels.
+// Every channel keeps its last W samples twice: in arrival order (to know which one to drop) and sorted (for the median).
+// A new sample is an outlier if it's further from the median of the window than 'threshold' scaled standard deviations,
+// estimated as 1.4826 * MAD (median absolute deviation), and further than 'minDeviation', so a flat signal doesn't turn every
+// small step into an outlier. Outliers are replaced by the median. Every sample (outlier or not) enters the window, so a real
+// change in level is followed after W/2 samples.
+// Insert/delete in the sorted window and the MAD are O(W) with no sorting, i.e. constant time per sample for a given W.
+// Memory is fixed at compile time. Has no Arduino dependencies so it can be compiled (and benchmarked) on the host.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+template <size_t N, size_t W>
+class HampelFilter {
+  public:
+    HampelFilter() {
+      reset(0, N);
+      for (size_t i = 0; i < N; i++) {
+        _rejected[i] = 0;
+      }
+    }
+
+    // Empties the windows of channels first..first+channels-1, e.g. when their sensor goes offline. Rejected counts are kept.
+    void reset(size_t first, size_t channels) {
+      for (size_t i = first; i < first + channels; i++) {
+        _size[i]   = 0;
+        _oldest[i] = 0;
+      }
+    }
+
+    // 'threshold' is in tenths of standard deviations (30 is the usual 3 sigma), 0 disables the channel's filtering.
+    // Returns true (and replaces 'value' with the median) if the sample is an outlier.
+    bool filter(size_t channel, int32_t &value, uint16_t threshold, int32_t minDeviation) {
+      bool outlier = false;
+      if (threshold && _size[channel] >= 3) {
+        int32_t median    = this->median(channel);
+        int64_t deviation = (int64_t)value - median;
+        if (deviation < 0) deviation = -deviation;
+        // deviation > threshold / 10 * 1.4826 * MAD
+        if (deviation > minDeviation && deviation * 100000 > (int64_t)threshold * 14826 * mad(channel, median)) {
+          outlier = true;
+          _rejected[channel]++;
+        }
+        insert(channel, value);
+        if (outlier) {
+          value = median;
+        }
+      } else {
+        insert(channel, value);
+      }
+      return outlier;
+    }
+
+    uint32_t rejected(size_t channel) const {
+      return _rejected[channel];
+    }
+
+  private:
+    void insert(size_t channel, int32_t value) {
+      int32_t *sorted = _sorted[channel];
+      size_t   size   = _size[channel];
+      if (size == W) { // Full, the oldest sample leaves the window
+        size_t position = find(sorted, size, _window[channel][_oldest[channel]]);
+        memmove(&sorted[position], &sorted[position + 1], (size - position - 1) * sizeof(int32_t));
+        size--;
+        _window[channel][_oldest[channel]] = value;
+        _oldest[channel] = (_oldest[channel] + 1) % W;
+      } else {
+        _window[channel][(_oldest[channel] + size) % W] = value;
+      }
+      size_t position = find(sorted, size, value);
+      memmove(&sorted[position + 1], &sorted[position], (size - position) * sizeof(int32_t));
+      sorted[position] = value;
+      _size[channel] = size + 1;
+    }
+
+    // First position in 'sorted' whose value isn't below 'value'
+    static size_t find(const int32_t *sorted, size_t size, int32_t value) {
+      size_t low = 0, high = size;
+      while (low < high) {
+        size_t middle = (low + high) / 2;
+        if (sorted[middle] < value) {
+          low = middle + 1;
+        } else {
+          high = middle;
+        }
+      }
+      return low;
+    }
+
+    int32_t median(size_t channel) const {
+      const int32_t *sorted = _sorted[channel];
+      size_t         size   = _size[channel];
+      return size % 2 ? sorted[size / 2] : (int32_t)(((int64_t)sorted[size / 2 - 1] + sorted[size / 2]) / 2);
+    }
+
+    // Deviations from the median are two sorted runs in the sorted window (going left and going right from the median),
+    // so their median is found by merging the runs up to the middle
+    int64_t mad(size_t channel, int32_t median) const {
+      const int32_t *sorted = _sorted[channel];
+      size_t         size   = _size[channel];
+      size_t         right  = find(sorted, size, median);
+      size_t         left   = right; // Deviations sorted[left - 1], sorted[left - 2]... and sorted[right], sorted[right + 1]...
+      int64_t        previous = 0, current = 0;
+      for (size_t i = 0; i <= size / 2; i++) {
+        previous = current;
+        if (right < size && (left == 0 || (int64_t)sorted[right] - median <= (int64_t)median - sorted[left - 1])) {
+          current = (int64_t)sorted[right++] - median;
+        } else {
+          current = (int64_t)median - sorted[--left];
+        }
+      }
+      return size % 2 ? current : (previous + current) / 2;
+    }
+
+    int32_t  _window[N][W]; // Arrival order, ring starting at _oldest
+    int32_t  _sorted[N][W];
+    uint8_t  _size[N];
+    uint8_t  _oldest[N];
+    uint32_t _rejected[N];  // Since boot
+};
@@ -12,13 +12,33 @@
 #include <WiFiUDP.h>
 #include <uptime_formatter.h> // https://github.com/YiannisBourkelis/Uptime-Library
 #include "rom/rtc.h"          // https://github.com/espressif/arduino-esp32/blob/master/libraries/ESP32/examples/ResetReason/ResetReason.ino
-#include <movingAvg.h>
 #include <esp_task_wdt.h>
+#include <esp_partition.h>
+#include <lwip/dns.h>
+#include <lwip/sockets.h>
+#include "SpecReading.h"
+#include "GasConversion.h"
+#include "SpscRing.h"
+#include "SensorRecovery.h"
+#include "SensorStats.h"
+#include "TimeWeightedWindow.h"
+#include "HampelFilter.h"
+#include "SensorRollup.h"
+#include "AirQualityIndex.h"
+#include "SensorReading.h"
+#include "RecordRing.h"
+#include "PayloadSchema.h"
+#include "PayloadCompact.h"
+#include "FieldTracker.h"
+#include "MqttOutbox.h"
+#include "CommandQueue.h"
 
 // -------------------------- Serial Print Macros ---------------------------------------
 #define spln(a)      (Serial.println(a))
 #define sp(a)        (Serial.print(a))
 #define spf(a, b)    (Serial.printf(a, b))
+#define stpln(a)     (sensorTaskLog.println(a)) // From the sensor task, loop() prints the line (see SensorTaskLog)
+#define stp(a)       (sensorTaskLog.print(a))
 
 // -------------------------- Pin Definitions -------------------------------------------
 #define NO2_RX_PIN      33
@@ -31,6 +51,15 @@
 #define RGB_PIN         19
 #define RGB_NUM_LEDS     1
 
+// -------------------------- Sensor Serial Ports ---------------------------------------
+// UART0 is the USB serial console, which leaves two hardware UARTs for three sensors
+#define SENSOR_SERIAL_HARDWARE 1 // 1: Sensors with a UART number below use that hardware UART, 0: all of them fall back to SoftwareSerial (bit-banged)
+#define SENSOR_UART_SOFTWARE  -1 // UART number of a sensor that uses SoftwareSerial
+#define PMS_UART_NUM           1 // Not a setting, PMserial's ESP32 (rx, tx) constructor always opens Serial1 on those pins
+#define SO2_UART_NUM           (SENSOR_SERIAL_HARDWARE ? 2 : SENSOR_UART_SOFTWARE)
+#define NO2_UART_NUM           SENSOR_UART_SOFTWARE
+#define SPEC_STREAMING         1 // 1: SO2 and NO2 stream every reading they make ("c" command), 0: request one reading per sensorDataReadInterval
+
 // -------------------------- WiFi ------------------------------------------------------
 const int      wifiReconnectInterval    = 10;
 bool           wifiConnectionLost       = false;
@@ -62,14 +91,138 @@ char*          MQTT_USERNAME;
 char           MQTT_PASSWORD[64];
 uint16_t       MQTT_MAX_MESSAGE_SIZE        = 2048;
 
+enum PayloadEncoding : uint8_t {
+  PAYLOAD_JSON    = 1 << 0,  // On the topic itself
+  PAYLOAD_MSGPACK = 1 << 1,  // Compact keys (PayloadSchema.h) on "<topic>/msgpack"
+  PAYLOAD_BOTH    = PAYLOAD_JSON | PAYLOAD_MSGPACK
+};
+const uint8_t  mqttPayloadEncoding          = PAYLOAD_JSON; // Which encodings ingest and metadata messages are published in
+const bool     mqttPayloadEcho              = true;  // Print published payloads (as JSON) to Serial
+const size_t   mqttPublishChunkSize         = 128;   // [bytes] Payloads are streamed to the network client in chunks of this size
+const uint8_t  mqttSensorDataQos            = 1;     // QoS of sensor data (0 or 1), QoS 1 messages are kept until the broker acknowledges them
+const size_t   mqttInflightWindow           = 4;     // Most QoS 1 messages waiting for an acknowledgement at once
+const size_t   mqttInflightSlotSize         = 2048;  // [bytes] Largest QoS 1 message (encoded, with its topic)
+
 const int      mqttReconnectInterval        = 15;    // Seconds between retries
+const int      mqttPhaseTimeout             = 10;    // [seconds] How long each connection phase may take before the attempt is given up
 bool           mqttConnectionLost           = false;
 unsigned long  mqttReconnectLastAttempt;
 
+enum MqttPhase : uint8_t { // Connecting is done in these steps by maintainMQTT(), none of which blocks the loop
+  MQTT_PHASE_IDLE,      // Not connected, waiting for the next attempt
+  MQTT_PHASE_RESOLVE,   // DNS lookup of MQTT_SERVER
+  MQTT_PHASE_CONNECT,   // TCP connect
+  MQTT_PHASE_HANDSHAKE, // MQTT CONNECT sent, waiting for the broker's CONNACK
+  MQTT_PHASE_SUBSCRIBE, // Unacknowledged messages sent again, topics subscribed
+  MQTT_PHASE_CONNECTED,
+  MQTT_PHASES
+};
+const char*    mqttPhaseNames[MQTT_PHASES]  = {"idle", "resolve", "connect", "handshake", "subscribe", "connected"};
+MqttPhase      mqttPhase                    = MQTT_PHASE_IDLE;
+unsigned long  mqttPhaseStart;
+uint32_t       mqttPhaseTime[MQTT_PHASES];           // [milliseconds] How long each phase of the last connection attempt took
+int            mqttSocket                   = -1;    // While the TCP connect is in progress, then it's handed to networkClient
+volatile bool     mqttResolveDone;                   // Set by the DNS callback (TCP/IP task)
+volatile uint32_t mqttResolvedAddress;               // 0 if the lookup failed
+volatile uint32_t mqttResolveGeneration;             // Callbacks of attempts that were given up are ignored
+const char*    mqttLastCommand              = NULL;  // Field of the last command received, for metadata
+uint32_t       mqttLastCommandLatency;               // [microseconds] How long it took to run
+
 const int      metadataPublishInterval      = 900;   // [seconds] How often to send metadata to platform
 const int      metadataPublishBootInterval  = 70;    // [seconds] How long after boot to send initial package of metadata
 bool           metadataPublishBootDone      = false; // If the initial metadata at boot is sent or not
 unsigned long  metadataLastPublish;
+const int      metadataFullInterval         = 21600; // [seconds] How often all metadata is sent, in between only the fields that changed are
+bool           metadataFullPending          = true;  // Send all metadata next time (boot, reconnect or the last full send failed)
+unsigned long  metadataLastFull;
+const char*    metadataUntrackedFields[]    = { "device_active_time", "device_wifi_rssi", "device_free_heap", "so2_active_time", "no2_active_time", "so2_uart_rx_bytes", "no2_uart_rx_bytes" }; // Not change-tracked, only sent along with other fields
+
+MqttOutbox<mqttInflightWindow, mqttInflightSlotSize> mqttOutbox; // Sent QoS 1 messages until they're acknowledged
+
+class MqttClientTap : public Client { // Passes everything through to 'client' and shows what's read to mqttOutbox (PUBACKs)
+  public:
+    MqttClientTap(Client &client) : _client(client), _replyPosition(sizeof _reply) {}
+
+    // The connection is opened by maintainMQTT() before PubSubClient sees it, so PubSubClient never connects (or blocks) itself
+    int connect(IPAddress ip, uint16_t port) override {
+      return 0;
+    }
+
+    int connect(const char* host, uint16_t port) override {
+      return 0;
+    }
+
+    // PubSubClient's connect() waits for the CONNACK, so it's given an accepting one right away. The broker's real one
+    // is picked up later by handshakeReply(), without blocking.
+    void beginHandshake() {
+      mqttOutbox.resetStream();
+      _replyPosition = 0;
+      _written       = 0;
+    }
+
+    // Bytes of CONNECT that went out, PubSubClient's connect() returns true without sending anything if it still thinks it's connected
+    size_t handshakeWritten() { return _written; }
+
+    // -1 while the broker's CONNACK hasn't arrived, its return code once it did (0: accepted, 0x80: not a CONNACK)
+    int handshakeReply() {
+      if (_client.available() < (int)sizeof _reply) {
+        return -1;
+      }
+      uint8_t reply[sizeof _reply];
+      _client.read(reply, sizeof reply);
+      return (reply[0] == _reply[0] && reply[1] == _reply[1]) ? reply[3] : 0x80;
+    }
+
+    size_t write(uint8_t b) override {
+      size_t result = _client.write(b);
+      _written += result;
+      return result;
+    }
+
+    size_t write(const uint8_t* buffer, size_t size) override {
+      size_t result = _client.write(buffer, size);
+      _written += result;
+      return result;
+    }
+
+    int read() override {
+      if (_replyPosition < sizeof _reply) {
+        return _reply[_replyPosition++];
+      }
+      int b = _client.read();
+      if (b >= 0) {
+        mqttOutbox.received(b);
+      }
+      return b;
+    }
+
+    int read(uint8_t* buffer, size_t size) override {
+      if (_replyPosition < sizeof _reply) {
+        size_t length = size < sizeof _reply - _replyPosition ? size : sizeof _reply - _replyPosition;
+        memcpy(buffer, _reply + _replyPosition, length);
+        _replyPosition += length;
+        return length;
+      }
+      int length = _client.read(buffer, size);
+      for (int i = 0; i < length; i++) {
+        mqttOutbox.received(buffer[i]);
+      }
+      return length;
+    }
+
+    int available() override { return _replyPosition < sizeof _reply ? sizeof _reply - _replyPosition : _client.available(); }
+    int peek() override { return _replyPosition < sizeof _reply ? _reply[_replyPosition] : _client.peek(); }
+    void flush() override { _client.flush(); }
+    void stop() override { _replyPosition = sizeof _reply; _client.stop(); }
+    uint8_t connected() override { return _client.connected(); }
+    operator bool() override { return _client; }
+
+  private:
+    Client &_client;
+    const uint8_t _reply[4] = {0x20, 0x02, 0x00, 0x00}; // CONNACK, connection accepted
+    size_t  _replyPosition;                             // Into _reply, sizeof _reply when it's not being read
+    size_t  _written = 0;                               // Since beginHandshake()
+};
 
 // -------------------------- Firmware Update (GitHub) -------------------------------------
 const String   firmwareVersion                  = "0.9.8";
@@ -117,85 +270,100 @@ const char*    fwRootCACertificate = \
 int            sensorDataPublishInterval            = 60;   // [seconds] [DEFAULT] How often to send sensor data. This variable changes depending on whats in device's memory
 const int      sensorDataPublishIntervalMax         = 600;  // Maximum user-settable data publishing interval
 const int      sensorDataPublishIntervalMin         = 30;   // Minimum user-settable data publishing interval
-int            sensorAveragingSamples               = 10;   // How many averaging samples to collect and average from
-int            sensorDataReadInterval               = sensorDataPublishInterval/sensorAveragingSamples; // How often to read sensor data (and average)
-const int      sensorDataReadIntervalWhenConsideredOffline = sensorDataPublishInterval * 2; // How often to read sensor (therefore check if it's available again) if it's considered that it isn't connected to the board
+const int      sensorAveragingSamples               = 10;   // How many times the sensors are read per publish interval
+volatile int   sensorDataReadInterval               = sensorDataPublishInterval/sensorAveragingSamples; // [seconds] How often to read sensor data (and average). Follows sensorDataPublishInterval, see applySensorDataPublishInterval()
+const int      sensorRecoveryIntervalMin            = 60;   // [seconds] How long to wait before checking again if an offline sensor is available. Doubles after every failed check...
+const int      sensorRecoveryIntervalMax            = 1800; // [seconds] ...up to this
+portMUX_TYPE   sensorRecoveryLock                   = portMUX_INITIALIZER_UNLOCKED; // Held by the sensor task while it updates a SensorRecovery, see sensorRecoveryRead()
 const uint8_t  sensorRetriesBeforeConsideredOffline = 5;    // After how many read attempts should the sensor be considered (and published as) offline and thus fall back to less frequent readings
 const int      sensorSerialWaitTime                 = 1500; // Milliseconds to wait before considering the sensor is unresponsive to the sent command
+const int      sensorSerialLineTimeout              = 1000; // Milliseconds to wait between characters once the sensor started replying
+const int      sensorSerialSettleTime               = 200;  // Milliseconds to let the sensor settle after opening its port and before waking it up
+const int      sensorSerialDrainTime                = 600;  // Milliseconds during which the reply to the wake-up command is discarded
+const int      specStreamTimeout                    = 5000; // Milliseconds without a streamed line before the read is considered failed
+const bool     sensorDataPublishSpread              = false; // Also publish the minimum, maximum, standard deviation and number of samples behind every averaged value
+const bool     sensorDataWallClockWindows           = true; // true: Publish time-weighted averages of windows aligned to the wall clock (multiples of sensorDataPublishInterval, e.g. exact minutes), false: average of the samples since the last publish
+const unsigned long wallClockValidEpoch             = 1609459200; // Clock is considered set by NTP once it's past 2021-01-01. Until then sensor data is published as if sensorDataWallClockWindows was false
 unsigned long  sensorDataLastPublish;
-unsigned long  sensorDataLastRead;
+unsigned long  sensorDataLastRead;              // Only used by the sensor task
 unsigned long  publishSensorDataLoopCurrentTime; // Used to keep track of time data started to be read & published instead of when it finished, so the intervals seen from the platform are more precise
 
+const int      readingStoreSectors                  = 64;  // Flash sectors (4 KB, 64 readings each) of the data partition that keep readings which couldn't be sent
+const int      readingStoreDrainInterval            = 500; // Milliseconds between stored readings sent once the platform is reachable again
+
+const int      sensorBatchMax                       = 10;   // Most readings a sensor data message can hold (memory for this many is reserved)
+const int      sensorBatchMaxBytes                  = 1900; // Largest batched sensor data message
+int            sensorBatchSize                      = 1;    // [DEFAULT] Readings per sensor data message, 1 sends every reading on its own. This variable changes depending on whats in device's memory
+
+const bool     gasConversionAtAmbient               = true; // true: PPB are converted to ug/m3 at the measured temperature and gasConversionPressure, false: at EU reference conditions (20 °C, 101.325 kPa)
+const int32_t  gasConversionPressure                = GAS_STANDARD_PRESSURE; // [Pa] Set to the average pressure at the installation site if it's far above sea level
+
 const char*    preferences_sensorDataPublishInterval = "pubInterval";
 int            preferences_sensorDataPublishIntervalDefault = sensorDataPublishInterval;
+const char*    preferences_sensorBatchSize          = "batchSize";
 const char*    preferences_LastZeroingDefault       = "NO INFO";
 const char*    preferences_LastFailedZeroingDefault = "NO INFO";
 const char*    preferences_SerialNumberDefault      = "NO INFO";
 
-
-// -------------------------- SO2 Sensor ------------------------------------------------
-#define        SO2_BAUD 9600             // Sensor Baud Rate
-bool           so2SensorOnline           = true; // Needs to be true so the metadata isn't sent at boot when the sensor initializes AND it can be flagged false once it fails during operation
-bool           so2SensorReady            = false;
-uint8_t        so2SensorRetryNumber      = 0;    // Current number of times the sensor has failed to respond
-unsigned long  so2SensorLastRecoveryAttemptTime; // Last time the sensor was checked while in less frequent reading mode (due to being offline)
-
-const float    so2MolarMass = 64.0638;     // SO2 Molar Mass
-int            so2AverageConcentration;    // Averaged ug/m3 value
-int            so2CurrentConcentration;    // Current ug/m3 Value
-int            so2CurrentConcentrationPPB; // Current value straight from sensor (PPB)
-int            so2CurrentConcentrationADC; // Current value from ADC converter
-int            so2AverageTemperature;      // Averaged value
-int            so2CurrentTemperature;
-int            so2CurrentTemperatureDigital;
-int            so2AverageHumidity;         // Averaged value
-int            so2CurrentHumidity;
-int            so2CurrentHumidityDigital;
-String         so2SensorUptime;
-int            so2SensorUptime_Days, so2SensorUptime_Hours, so2SensorUptime_Minutes, so2SensorUptime_Seconds;
-
-String         so2Firmware;
-String         so2SerialNumber;
-const char*    preferences_so2SerialNumber      = "so2Serial";
-String         so2LastZeroing;
-const char*    preferences_so2LastZeroing       = "so2Zeroed";
-String         so2LastFailedZeroing;
-const char*    preferences_so2LastFailedZeroing = "so2ZeroFailed";
-
-// -------------------------- NO2 Sensor ------------------------------------------------
-#define        NO2_BAUD 9600             // Sensor Baud Rate
-bool           no2SensorOnline           = true;
-bool           no2SensorReady            = false;
-uint8_t        no2SensorRetryNumber      = 0;    // Current number of times the sensor has failed to respond
-unsigned long  no2SensorLastRecoveryAttemptTime; // Last time the sensor was checked while in less frequent reading mode (due to being offline)
-
-const float    no2MolarMass = 46.0055;           // NO2 Molar Mass
-int            no2AverageConcentration;          // Averaged ug/m3 value
-int            no2CurrentConcentration;          // Current ug/m3 Value
-int            no2CurrentConcentrationPPB;       // Current value straight from sensor (PPB)
-int            no2CurrentConcentrationADC;       // Current value from ADC converter
-int            no2AverageTemperature;            // Averaged value
-int            no2CurrentTemperature;
-int            no2CurrentTemperatureDigital;
-int            no2AverageHumidity;               // Averaged value
-int            no2CurrentHumidity;
-int            no2CurrentHumidityDigital;
-String         no2SensorUptime;
-int            no2SensorUptime_Days, no2SensorUptime_Hours, no2SensorUptime_Minutes, no2SensorUptime_Seconds;
-
-String         no2Firmware;
-String         no2SerialNumber;
-const char*    preferences_no2SerialNumber      = "no2Serial"; // Variable name the way it will be stored in persistant memory
-String         no2LastZeroing;
-const char*    preferences_no2LastZeroing       = "no2Zeroed"; // Variable name the way it will be stored in persistant memory
-String         no2LastFailedZeroing;
-const char*    preferences_no2LastFailedZeroing = "no2ZeroFailed"; // Variable name the way it will be stored in persistant memory
+// -------------------------- Sensor Serial Transport -----------------------------------
+const int      sensorSerialRxBufferSize = 256; // Fits a few whole SPEC data lines (~70 characters each)
+
+// One serial port of a sensor, either on a hardware UART or SoftwareSerial, with its error statistics
+struct SensorSerial {
+  const char*        name;
+  int8_t             rxPin;
+  int8_t             txPin;
+  uint32_t           baud;
+  HardwareSerial*    hardware;       // NULL if the port uses SoftwareSerial
+  SoftwareSerial*    software;       // NULL if the port uses a hardware UART
+  Stream*            stream;
+  OnReceiveErrorCb   onError;        // Hardware UART only, counts errors reported by the UART driver
+  volatile uint32_t  bytesReceived;
+  volatile uint32_t  framingErrors;  // Hardware UART only, SoftwareSerial can't detect these
+  volatile uint32_t  parityErrors;
+  volatile uint32_t  overflows;      // Bytes lost because the FIFO or the receive buffer was full
+};
+
+// SO2 and NO2 sensors are driven by a request/response state machine so that waiting for a reply never blocks loop()
+enum SpecState : uint8_t {
+  SPEC_IDLE,             // No transaction in progress
+  SPEC_INIT_SETTLE,      // Port just opened, waiting before asking for the firmware version
+  SPEC_INIT_WAIT_FW,     // "fw" sent, waiting for the firmware version
+  SPEC_INIT_WAKE,        // Firmware version received, waiting before sending the wake-up command
+  SPEC_INIT_DRAIN,       // Wake-up command sent, discarding whatever the sensor replies with
+  SPEC_READ_WAIT,        // Data requested, waiting for the data line
+  SPEC_ZERO_WAIT_ECHO,   // Zeroing requested, waiting for the first (empty) line
+  SPEC_ZERO_WAIT_RESULT, // Waiting for the zeroing result line
+  SPEC_STREAM,           // "c" sent, the sensor outputs a data line about once a second until it's stopped
+  SPEC_STREAM_STOP       // Streaming stopped, discarding the lines that were already on their way
+};
+
+enum SpecEvent : uint8_t {
+  SPEC_EVENT_NONE,
+  SPEC_EVENT_INIT_OK,
+  SPEC_EVENT_INIT_FAILED,
+  SPEC_EVENT_READ_OK,
+  SPEC_EVENT_READ_FAILED,
+  SPEC_EVENT_ZERO_OK,
+  SPEC_EVENT_ZERO_FAILED
+};
+
+struct SpecPort {
+  const char*    name;               // Used as log prefix
+  SensorSerial*  serial;
+  SpecState      state;
+  unsigned long  stateSince;         // millis() when the current state was entered (or the last character was received)
+  unsigned long  stateTimeout;       // Milliseconds the current state may last
+  volatile bool  zeroRequested;      // Zeroing will start as soon as the current transaction is done (set from loop())
+  char           line[96];           // Reply currently being received
+  uint8_t        lineLength;
+};
 
 // -------------------------- PMS Sensor ------------------------------------------------
 #define        PMS_BAUD 9600                     // Sensor Baud Rate
-bool           pmsSensorOnline                  = true;
+volatile bool  pmsSensorOnline                  = true;
 uint8_t        pmsSensorRetryNumber             = 0;
-unsigned long  pmsSensorLastRecoveryAttemptTime; // Last time the sensor was checked while in less frequent reading mode (due to being offline)
+SensorRecovery pmsSensorRecovery                = sensorRecoveryMake(sensorRecoveryIntervalMin * 1000, sensorRecoveryIntervalMax * 1000); // Schedules the checks while the sensor is offline
 
 int            pm1Current;
 int            pm1Average;                       // Averaged value
@@ -205,6 +373,298 @@ int            pm10Current;
 int            pm10Average;                      // Averaged value
 unsigned long  pmsLastRead;
 
+// -------------------------- Sensor Task -----------------------------------------------
+// Sensors are read by their own task, which hands what it reads over to loop() as events
+enum SensorId : uint8_t {
+  SENSOR_SO2,
+  SENSOR_NO2,
+  SENSOR_PMS
+};
+
+enum SensorEventType : uint8_t {
+  SENSOR_EVENT_SAMPLE,       // New reading
+  SENSOR_EVENT_ONLINE,       // Sensor initialized or came back online
+  SENSOR_EVENT_OFFLINE,      // Sensor stopped responding and is now considered offline
+  SENSOR_EVENT_ZERO_OK,
+  SENSOR_EVENT_ZERO_FAILED,
+  SENSOR_EVENT_READ_CYCLE    // All sensors polled in a read cycle replied (or the deadline passed)
+};
+
+struct SensorEvent {
+  SensorEventType type;
+  SensorId        sensor;
+  bool            recovered;         // ONLINE: Sensor was offline during operation
+  char            firmware[8];       // ONLINE: SO2/NO2 firmware version
+  SpecReading     spec;              // SAMPLE: SO2/NO2 reading
+  uint16_t        pm01, pm25, pm10;  // SAMPLE: PMS reading
+  int64_t         timestamp;         // esp_timer_get_time() when the event was posted [microseconds]
+  uint32_t        time;              // millis() when the event was posted (timestamp / 1000)
+  uint32_t        cycleLatency;      // READ_CYCLE: Milliseconds from the first request to the last reply
+  bool            deadlineMissed;    // READ_CYCLE: At least one sensor didn't reply before readCycleDeadline
+};
+
+const uint32_t sensorTaskStackSize    = 4096;
+const int      sensorTaskPollInterval = 20; // [milliseconds] How often the sensor task services the sensor ports if it isn't woken up by received data
+TaskHandle_t   sensorTaskHandle;
+SpscRing<SensorEvent, 32> sensorEvents;     // Sensor task -> loop()
+volatile uint32_t sensorEventsDropped;      // Since boot, events the sensor task couldn't queue because loop() was busy (e.g. a firmware update)
+
+struct SensorLogLine {
+  char text[128]; // Longer lines are cut short
+};
+
+class SensorTaskLog : public Print { // Lines printed by the sensor task, queued for loop() so the two cores don't interleave
+  public:                            // on Serial and the sensor task never waits for the UART to send them
+    SensorTaskLog() : _length(0) {}
+
+    size_t write(uint8_t c) override {
+      if (c == '\n') {
+        _line.text[_length] = '\0';
+        _lines.push(_line); // Dropped (and counted) if loop() fell behind
+        _length = 0;
+      } else if (c != '\r' && _length < sizeof _line.text - 1) {
+        _line.text[_length++] = c;
+      }
+      return 1;
+    }
+
+    bool pop(SensorLogLine &line) { // loop()
+      return _lines.pop(line);
+    }
+
+  private:
+    SensorLogLine               _line;   // Line being printed
+    size_t                      _length;
+    SpscRing<SensorLogLine, 16> _lines;
+};
+SensorTaskLog  sensorTaskLog;
+
+// All sensors are asked for data at once and a read cycle lasts as long as the slowest one takes to reply
+const int      readCycleDeadline       = 3000; // [milliseconds] Cycle is closed after this even if a sensor still hasn't replied
+uint8_t        readCyclePending;               // Bit per SensorId that hasn't replied yet (sensor task)
+unsigned long  readCycleStart;                 // (sensor task)
+uint32_t       readCycleCount;                 // Read cycle statistics since metadata was last sent (loop())
+uint32_t       readCycleLatencyLast;
+uint32_t       readCycleLatencySum;
+uint32_t       readCycleLatencyMax;
+uint32_t       readCycleDeadlineMisses;        // Since boot
+
+// -------------------------- Sensor Statistics -----------------------------------------
+// Every averaged value is a channel. Channels of one sensor are adjacent so they're updated together.
+enum StatsChannel : uint8_t {
+  STATS_SO2,              // Tenths of ug/m3
+  STATS_SO2_TEMPERATURE,
+  STATS_SO2_HUMIDITY,
+  STATS_NO2,              // Tenths of ug/m3
+  STATS_NO2_TEMPERATURE,
+  STATS_NO2_HUMIDITY,
+  STATS_PM1,
+  STATS_PM2_5,
+  STATS_PM10,
+  STATS_CHANNEL_COUNT
+};
+
+// Outlier rejection per channel: threshold in tenths of standard deviations (0 disables it) and the smallest deviation
+// from the median (in the channel's unit) that can be an outlier, so a flat signal doesn't make every small step one
+struct SensorChannelConfig {
+  const char* name;                // Metadata key prefix
+  uint16_t    outlierThreshold;
+  int32_t     outlierMinDeviation;
+};
+
+const SensorChannelConfig sensorChannels[STATS_CHANNEL_COUNT] = {
+  { "so2",             30, 50 },  // 5 ug/m3
+  { "so2_temperature", 30, 3  },
+  { "so2_humidity",    30, 10 },
+  { "no2",             30, 50 },  // 5 ug/m3
+  { "no2_temperature", 30, 3  },
+  { "no2_humidity",    30, 10 },
+  { "pms_pm1",         30, 10 },
+  { "pms_pm2_5",       30, 10 },
+  { "pms_pm10",        30, 10 },
+};
+
+const size_t   sensorFilterWindow = 7; // Samples per channel the outlier filter compares a new one against
+
+HampelFilter<STATS_CHANNEL_COUNT, sensorFilterWindow> sensorFilter; // Between parsing and averaging (loop())
+SensorStats<STATS_CHANNEL_COUNT> sensorStats; // Statistics of the samples since sensor data was last published (loop())
+
+struct WallClockWindow {
+  TimeWeightedWindow<STATS_CHANNEL_COUNT> averages;
+  bool           active;     // Clock is set and the window is in use
+  unsigned long  startEpoch; // [seconds]
+  unsigned long  length;     // [seconds]
+};
+
+WallClockWindow sensorWindow; // Published averages, sensorDataPublishInterval long (loop())
+WallClockWindow rollupWindow; // One minute, added to sensorRollup when it ends (loop())
+int64_t        sensorLastSampleTimestamp; // esp_timer_get_time() of the newest sample, 0 if there's none yet (loop())
+SensorRollup<STATS_CHANNEL_COUNT> sensorRollup;
+const uint8_t  rollupMinCoverage = 75; // [%] Rollups (and the air quality index based on them) are published only if they're covered at least this much
+const char*    rollupNames[ROLLUP_LEVEL_COUNT] = { "1m", "15m", "1h", "24h" }; // Payload key suffixes
+
+// Rollups that are published and what the air quality index is computed from
+struct AqiSource {
+  AqiPollutant pollutant;
+  const char*  name;    // Payload key prefix
+  uint8_t      channel;
+  RollupLevel  level;   // Averaging period the index is defined for
+  float        scale;   // To ug/m3
+};
+
+const AqiSource aqiSources[AQI_POLLUTANT_COUNT] = {
+  { AQI_PM2_5, "PM2_5", STATS_PM2_5, ROLLUP_24H, 1   },
+  { AQI_PM10,  "PM10",  STATS_PM10,  ROLLUP_24H, 1   },
+  { AQI_NO2,   "NO2",   STATS_NO2,   ROLLUP_1H,  0.1 },
+  { AQI_SO2,   "SO2",   STATS_SO2,   ROLLUP_1H,  0.1 },
+};
+
+void sensorFilterApply(uint8_t first, int32_t *values, uint8_t channels) { // Replaces outliers in a sample with the median of their channel
+  for (uint8_t i = 0; i < channels; i++) {
+    const SensorChannelConfig &config = sensorChannels[first + i];
+    int32_t value = values[i];
+    if (sensorFilter.filter(first + i, values[i], config.outlierThreshold, config.outlierMinDeviation)) {
+      sp("[DATA] Outlier rejected on ");
+      sp(config.name);
+      sp(": ");
+      sp(value);
+      sp(", replaced with ");
+      spln(values[i]);
+    }
+  }
+}
+
+uint32_t sensorReadMaxHold() { // A polled reading stands for the time until the next one is due, plus however late that one may be
+  return sensorDataReadInterval * 1000 + readCycleDeadline;
+}
+
+// -------------------------- Store-and-Forward -----------------------------------------
+// Readings that fail to publish are kept in the (otherwise unused) SPIFFS data partition, used as raw flash so the partition
+// table (and thus devices updated over the air) doesn't change, and are sent once the platform is reachable again
+struct PartitionStorage {
+  const esp_partition_t* partition;
+
+  bool read(uint32_t address, void* data, size_t size) {
+    return esp_partition_read(partition, address, data, size) == ESP_OK;
+  }
+  bool write(uint32_t address, const void* data, size_t size) {
+    return esp_partition_write(partition, address, data, size) == ESP_OK;
+  }
+  bool erase(uint32_t address, size_t size) {
+    return esp_partition_erase_range(partition, address, size) == ESP_OK;
+  }
+};
+
+PartitionStorage readingStorage;
+RecordRing<PartitionStorage, SensorReading> readingStore(readingStorage);
+uint32_t       readingStoreLost;      // Readings that couldn't be stored at all (no partition, no time yet or a flash error)
+unsigned long  readingStoreLastDrain;
+
+SensorReading  sensorBatch[sensorBatchMax]; // Readings waiting to be published together (loop())
+uint8_t        sensorBatchCount;
+
+// -------------------------- Gas Sensors (SPEC DGS) ------------------------------------
+// Everything that differs between the SO2 and NO2 sensors is a compile-time trait, the driver (GasSensor) is shared.
+// Adding another DGS sensor (e.g. O3 or CO) takes a SensorId, a traits struct, a GasSensor object and hooking it up where so2/no2 are.
+static_assert(SO2_UART_NUM != 0 && NO2_UART_NUM != 0, "UART0 is the serial console");
+static_assert(SO2_UART_NUM != PMS_UART_NUM && NO2_UART_NUM != PMS_UART_NUM, "PMS7003 already uses this UART");
+static_assert(SO2_UART_NUM != NO2_UART_NUM || SO2_UART_NUM == SENSOR_UART_SOFTWARE, "SO2 and NO2 can't share a UART");
+
+template <int8_t UartNum> // Hardware UART UartNum, or SoftwareSerial for SENSOR_UART_SOFTWARE (see the specialization)
+struct SensorUart : HardwareSerial {
+  SensorUart() : HardwareSerial(UartNum) {}
+};
+
+template <>
+struct SensorUart<SENSOR_UART_SOFTWARE> : SoftwareSerial {};
+
+struct SO2Traits {
+  static constexpr SensorId    id                           = SENSOR_SO2;
+  static constexpr const char* name                         = "SO2";     // Log prefix
+  static constexpr const char* key                          = "so2";     // Metadata key prefix
+  static constexpr StatsChannel statsChannel                = STATS_SO2; // Followed by temperature and humidity
+  static constexpr int32_t     coefficient                  = gasCoefficient(64.0638); // Molar mass 64.0638 g/mol
+  static constexpr int         temperatureOffset            = -2;
+  static constexpr int         humidityOffset               = -1;
+  static constexpr int8_t      rxPin                        = SO2_RX_PIN;
+  static constexpr int8_t      txPin                        = SO2_TX_PIN;
+  static constexpr uint32_t    baud                         = 9600;
+  static constexpr int8_t      uartNum                      = SO2_UART_NUM;
+  static constexpr const char* preferencesSerialNumber      = "so2Serial"; // Variable names the way they're stored in persistant memory
+  static constexpr const char* preferencesLastZeroing       = "so2Zeroed";
+  static constexpr const char* preferencesLastFailedZeroing = "so2ZeroFailed";
+};
+
+struct NO2Traits {
+  static constexpr SensorId    id                           = SENSOR_NO2;
+  static constexpr const char* name                         = "NO2";
+  static constexpr const char* key                          = "no2";
+  static constexpr StatsChannel statsChannel                = STATS_NO2;
+  static constexpr int32_t     coefficient                  = gasCoefficient(46.0055); // Molar mass 46.0055 g/mol
+  static constexpr int         temperatureOffset            = -2;
+  static constexpr int         humidityOffset               = -1;
+  static constexpr int8_t      rxPin                        = NO2_RX_PIN;
+  static constexpr int8_t      txPin                        = NO2_TX_PIN;
+  static constexpr uint32_t    baud                         = 9600;
+  static constexpr int8_t      uartNum                      = NO2_UART_NUM;
+  static constexpr const char* preferencesSerialNumber      = "no2Serial";
+  static constexpr const char* preferencesLastZeroing       = "no2Zeroed";
+  static constexpr const char* preferencesLastFailedZeroing = "no2ZeroFailed";
+};
+
+template <typename Traits>
+class GasSensor {
+  public:
+    GasSensor();
+    void readPersistantStorage();               // setup()
+    void init();                                // Sensor task, opens the port and starts initialization
+    bool read();                                // Sensor task, requests data (the reply is handled by readFinished())
+    void readLoop(unsigned long currentTime);   // Sensor task, called every sensorDataReadInterval
+    void loop();                                // Sensor task, drives the transactions and handles their results
+    void requestZero();                         // loop()
+    void handleEvent(const SensorEvent &event); // loop()
+    void eraseZeroing();                        // loop()
+    void addMetadata(JsonObject data);          // loop()
+    void windowClosed();                        // loop(), takes the averages from the wall-clock window that was just closed
+
+    SensorUart<Traits::uartNum> uart;
+    SensorSerial   serial;
+    SpecPort       port;
+
+    volatile bool  online                   = true;  // Needs to be true so the metadata isn't sent at boot when the sensor initializes AND it can be flagged false once it fails during operation
+    bool           ready                    = false;
+    uint8_t        retryNumber              = 0;     // Current number of times the sensor has failed to respond
+    SensorRecovery recovery                 = sensorRecoveryMake(sensorRecoveryIntervalMin * 1000, sensorRecoveryIntervalMax * 1000); // Schedules the checks while the sensor is offline
+    uint32_t       lineErrorsSeen           = 0;     // Framing + parity errors at the last check, new ones while offline mean something is on the line
+    bool           publishMetadataAfterRead = false; // Set when the sensor comes back online so metadata is sent once its data is read
+
+    int            averageConcentration;      // Averaged ug/m3 value since sensor data was last published
+    int            currentConcentration;      // Current ug/m3 Value
+    int32_t        currentConcentrationTenths; // Current value in tenths of ug/m3, this is what gets averaged
+    int            currentConcentrationPPB;   // Current value straight from sensor (PPB)
+    int            currentConcentrationADC;   // Current value from ADC converter
+    int            averageTemperature;        // Averaged value
+    int            currentTemperature;
+    int32_t        currentTemperatureTenths;  // From the raw (digital) reading, used for the ug/m3 conversion
+    int            currentTemperatureDigital;
+    int            averageHumidity;           // Averaged value
+    int            currentHumidity;
+    int            currentHumidityDigital;
+    char           uptime[64];
+
+    String         firmware;
+    String         serialNumber;
+    String         lastZeroing;
+    String         lastFailedZeroing;
+
+  private:
+    void initFinished(bool success);
+    bool readFinished(bool replied);
+    void zeroFinished(bool success);
+    void handleSample(const SpecReading &reading, uint32_t time);
+    void resetAverages();
+};
+
 // -------------------------- RGB LED ---------------------------------------------------
 bool           rgbEffect_WiFi                  = false;
 bool           rgbEffect_WiFiExpire            = false;
@@ -244,66 +704,72 @@ String         resetReason    = "UNKNOWN";
 const int      wdtTimeout     = 90; // If the device hangs for this many seconds, reset it
 
 // -------------------------- Objects ---------------------------------------------------
-SoftwareSerial no2Serial;
-SoftwareSerial so2Serial;
+GasSensor<SO2Traits> so2;
+GasSensor<NO2Traits> no2;
 CRGB rgb[RGB_NUM_LEDS];
-SerialPM pms(PMS7003, PMS_RX_PIN, PMS_TX_PIN); // https://github.com/avaldebe/PMserial/tree/master/examples/SoftwareSerial
+SerialPM pms(PMS7003, PMS_RX_PIN, PMS_TX_PIN); // On ESP32 this is Serial1 (PMS_UART_NUM) with the pins remapped
 WiFiManager wm;
 WiFiManagerParameter portalMqttPassword("mqtt_password", "Platform Password", "do not change unless instructed", 64);
 WiFiManagerParameter portalDisplayFirmwareVersion(firmwareVersionPortal);
 WiFiManagerParameter portalDisplayCredits("Hardware & Firmware Designed, Developed and Maintained by Vanja Stanic");
 WiFiClient networkClient;
-PubSubClient mqtt(networkClient);
+MqttClientTap mqttClient(networkClient);
+PubSubClient mqtt(mqttClient);
 Preferences preferences;
 WiFiUDP ntpUDP;
 NTPClient timeClient(ntpUDP);
-movingAvg avgSo2(sensorAveragingSamples);
-movingAvg avgSo2Temp(sensorAveragingSamples);
-movingAvg avgSo2Hum(sensorAveragingSamples);
-movingAvg avgNo2(sensorAveragingSamples);
-movingAvg avgNo2Temp(sensorAveragingSamples);
-movingAvg avgNo2Hum(sensorAveragingSamples);
-movingAvg avgPM1(sensorAveragingSamples);
-movingAvg avgPM25(sensorAveragingSamples);
-movingAvg avgPM10(sensorAveragingSamples);
+DynamicJsonDocument publishDocument(sensorBatchMax * 512 + 1024); // Reused by every publish, allocated once at boot
+DynamicJsonDocument publishCompactDocument(mqttPayloadEncoding & PAYLOAD_MSGPACK ? sensorBatchMax * 512 + 1024 : 0);
+DynamicJsonDocument metadataSnapshot(3072);  // Current values of the metadata fields that can change (about 70, with copied keys and strings)
+StaticJsonDocument<384> metadataStatic;      // Fields that can't change until the next boot, collected once
+FieldTracker<96> metadataFields;             // Last sent value of each field
 
 // Forward-declaration
-bool initSO2();
-bool initNO2();
-bool readSO2();
-bool readNO2();
-void publishMetadata();
+void publishMetadata(bool full = false);
+bool mqttPublishPayload(const char* topic, JsonDocument &doc, bool retained, uint8_t qos = 0);
+bool mqttReady();
+void postSensorEvent(SensorEvent &event);
+void applySensorDataPublishInterval();
+void readCycleReplied(SensorId sensor);
+void sensorSerialDataReceived();
+void mqttCommandZeroFinished(SensorId sensor, bool success);
+
+SensorRecovery sensorRecoveryRead(const SensorRecovery &recovery) { // Copy for loop() that the sensor task isn't halfway through updating (offlineTime is 64-bit)
+  portENTER_CRITICAL(&sensorRecoveryLock);
+  SensorRecovery copy = recovery;
+  portEXIT_CRITICAL(&sensorRecoveryLock);
+  return copy;
+}
 
 void readPersistantStorage() {
   String TEMP_MQTT_PASSWORD;
   preferences.begin("klimerko", false);
   TEMP_MQTT_PASSWORD   = preferences.getString("mqtt_password", "UNDEFINED"); // Load the "mqtt_password" stored in memory and make it "UNDEFINED" if it doesn't already exist
-  so2SerialNumber      = preferences.getString(preferences_so2SerialNumber, preferences_SerialNumberDefault);
-  so2LastZeroing       = preferences.getString(preferences_so2LastZeroing, preferences_LastZeroingDefault);
-  so2LastFailedZeroing = preferences.getString(preferences_so2LastFailedZeroing, preferences_LastFailedZeroingDefault);
-  no2SerialNumber      = preferences.getString(preferences_no2SerialNumber, preferences_SerialNumberDefault);
-  no2LastZeroing       = preferences.getString(preferences_no2LastZeroing, preferences_LastZeroingDefault);
-  no2LastFailedZeroing = preferences.getString(preferences_no2LastFailedZeroing, preferences_LastFailedZeroingDefault);
+  so2.readPersistantStorage();
+  no2.readPersistantStorage();
   lastSuccessfulOTA    = preferences.getString(preferences_lastSuccessfulOTA, preferences_lastSuccessfulOTADefault);
   lastFailedOTA        = preferences.getString(preferences_lastFailedOTA, preferences_lastFailedOTADefault);
   sensorDataPublishInterval = preferences.getInt(preferences_sensorDataPublishInterval, preferences_sensorDataPublishIntervalDefault);
+  sensorBatchSize      = preferences.getInt(preferences_sensorBatchSize, sensorBatchSize);
+  sensorBatchSize      = constrain(sensorBatchSize, 1, sensorBatchMax);
   preferences.end();
+  applySensorDataPublishInterval();
   TEMP_MQTT_PASSWORD.toCharArray(MQTT_PASSWORD, 64);
 
   sp("[Persistant Storage] MQTT Password: ");
   spln(MQTT_PASSWORD);
   sp("[Persistant Storage] SO2 Serial Number at: ");
-  spln(so2SerialNumber);
+  spln(so2.serialNumber);
   sp("[Persistant Storage] SO2 Last Zeroed at: ");
-  spln(so2LastZeroing);
+  spln(so2.lastZeroing);
   sp("[Persistant Storage] SO2 Last Failed Zeroing at: ");
-  spln(so2LastFailedZeroing);
+  spln(so2.lastFailedZeroing);
   sp("[Persistant Storage] NO2 Serial Number at: ");
-  spln(no2SerialNumber);
+  spln(no2.serialNumber);
   sp("[Persistant Storage] NO2 Last Zeroed at: ");
-  spln(no2LastZeroing);
+  spln(no2.lastZeroing);
   sp("[Persistant Storage] NO2 Last Failed Zeroing at: ");
-  spln(no2LastFailedZeroing);
+  spln(no2.lastFailedZeroing);
   sp("[Persistant Storage] Last Succesful OTA Update at: ");
   spln(lastSuccessfulOTA);
   sp("[Persistant Storage] Last Failed OTA Update at: ");
@@ -312,494 +778,918 @@ void readPersistantStorage() {
   spln(sensorDataPublishInterval);
 }
 
-bool initSO2() {
-  sp("[SO2] Initializing... ");
-  so2Serial.begin(SO2_BAUD, SWSERIAL_8E1, SO2_RX_PIN, SO2_TX_PIN, false);
-  so2Serial.flush();
-  delay(200); // TODO: Sensor fails to init (once) at first boot (when the board is first plugged into power)
-  so2Serial.write("fw");
-  unsigned long sensorSerialWaitStart = millis();
-  while (!so2Serial.available()) {
-    if (millis() - sensorSerialWaitStart >= sensorSerialWaitTime) {
-      spln("Failed! Sensor didn't reply in time.");
-      so2SensorOnline = false;
-      return false;
-    }
+void sensorSerialBegin(SensorSerial &port) { // Opens the port with the SPEC sensors' 8E1 framing
+  if (port.hardware) {
+    port.hardware->setRxBufferSize(sensorSerialRxBufferSize);
+    port.hardware->begin(port.baud, SERIAL_8E1, port.rxPin, port.txPin);
+    port.hardware->onReceiveError(port.onError);
+    port.hardware->onReceive(sensorSerialDataReceived); // Wakes the sensor task as soon as data arrives
+  } else {
+    port.software->begin(port.baud, SWSERIAL_8E1, port.rxPin, port.txPin, false, sensorSerialRxBufferSize);
   }
-  String checkString = so2Serial.readStringUntil('\r');
-  sp("Sensor Returned: ");
-  sp(checkString);
-  sp(", which is ");
-  sp(checkString.length());
-  sp(" characters long. ");
-  if (checkString.length() == 7) {
-    so2SensorRetryNumber = 0;
-    so2Firmware = checkString;
-    delay(200);
-    so2Serial.write("\r"); // Seems to be required so the sensor doesn't return an empty string on next read
-    delay(500);
-    so2Serial.flush();
-    delay(100);
-    spln("Successfully initialized!");
-    if (!so2SensorOnline) { // If the sensor was previously offline during operation, send metadata to update that it's online
-      so2SensorOnline = true;
-      readSO2(); // Needs to read SO2 sensor data so that the sensor part of the metadata payload isn't empty
-      publishMetadata();
-    }
-    return true;
+}
+
+void sensorSerialEnd(SensorSerial &port) {
+  if (port.hardware) {
+    port.hardware->end();
+  } else {
+    port.software->end();
   }
-  spln("Failed! Sensor didn't return the correct Firmware Version length.");
-  so2SensorOnline = false;
-  return false;
 }
 
-bool initNO2() {
-  sp("[NO2] Initializing... ");
-  no2Serial.begin(NO2_BAUD, SWSERIAL_8E1, NO2_RX_PIN, NO2_TX_PIN, false);
-  no2Serial.flush();
-  delay(200);
-  no2Serial.write("fw");
-  unsigned long sensorSerialWaitStart = millis();
-  while (!no2Serial.available()) {
-    if (millis() - sensorSerialWaitStart >= sensorSerialWaitTime) {
-      spln("Failed! Sensor didn't reply in time.");
-      no2SensorOnline = false;
-      return false;
+int sensorSerialRead(SensorSerial &port) {
+  if (port.software) { // Hardware UARTs report errors through onError, SoftwareSerial has to be checked byte by byte
+    if (port.software->overflow()) {
+      port.overflows++;
+    }
+    int next = port.software->peek();
+    if (next >= 0 && port.software->readParity() != SoftwareSerial::parityEven(next)) {
+      port.parityErrors++;
     }
   }
-  String checkString = no2Serial.readStringUntil('\r');
-  sp("Sensor Returned: ");
-  sp(checkString);
-  sp(", which is ");
-  sp(checkString.length());
-  sp(" characters long. ");
-  if (checkString.length() == 7) {
-    no2SensorRetryNumber = 0;
-    no2Firmware = checkString;
-    delay(200);
-    no2Serial.write("\r"); // Seems to be required so the sensor doesn't return an empty string on next read
-    delay(500);
-    no2Serial.flush();
-    delay(100);
-    spln("Successfully initialized!");
-    if (!no2SensorOnline) { // If the sensor was previously offline during operation, send metadata to update that it's online
-      no2SensorOnline = true;
-      readNO2(); // Needs to read NO2 sensor data so that the sensor part of metadata isn't empty
-      publishMetadata();
+  int c = port.stream->read();
+  if (c >= 0) {
+    port.bytesReceived++;
+  }
+  return c;
+}
+
+void sensorSerialCountError(SensorSerial &port, hardwareSerial_error_t error) { // Called from the UART driver's event task
+  switch (error) {
+    case UART_FRAME_ERROR:
+      port.framingErrors++;
+      break;
+    case UART_PARITY_ERROR:
+      port.parityErrors++;
+      break;
+    case UART_FIFO_OVF_ERROR:
+    case UART_BUFFER_FULL_ERROR:
+      port.overflows++;
+      break;
+    default:
+      break;
+  }
+}
+
+void specSetState(SpecPort &port, SpecState state, unsigned long timeout) {
+  port.state        = state;
+  port.stateSince   = millis();
+  port.stateTimeout = timeout;
+}
+
+void specDiscardInput(SpecPort &port) {
+  while (port.serial->stream->available()) {
+    sensorSerialRead(*port.serial);
+  }
+}
+
+// Buffers whatever the sensor has sent so far. Returns true once a whole line ending with 'terminator' is received.
+bool specCollectLine(SpecPort &port, char terminator) {
+  while (port.serial->stream->available()) {
+    char c = sensorSerialRead(*port.serial);
+    // Once the sensor starts replying, only the time between characters counts (same as Stream's readStringUntil timeout)
+    port.stateSince   = millis();
+    port.stateTimeout = sensorSerialLineTimeout;
+    if (c == terminator) {
+      port.line[port.lineLength] = '\0';
+      return true;
+    }
+    if (port.lineLength < sizeof(port.line) - 1) {
+      port.line[port.lineLength++] = c;
     }
-    return true;
   }
-  spln("Failed! Sensor didn't return the correct Firmware Version length.");
-  no2SensorOnline = false;
   return false;
 }
 
-void publishMetadata() {
-  sp("[DATA] Sending metadata to platform: ");
-  timeClient.update();
-  char JSONmessageBuffer[2048];
+bool specBusy(SpecPort &port) {
+  return port.state != SPEC_IDLE || port.zeroRequested;
+}
 
-  DynamicJsonDocument doc(2048);
-  doc["type"] = "device_metadata";
-  doc["client_id"] = MQTT_CLIENT_ID;
-  doc["correlation_id"] = MQTT_CLIENT_ID;
-  doc["sent_at"] = timeClient.getFormattedDate();
+bool specStreaming(SpecPort &port) {
+  return port.state == SPEC_STREAM || port.state == SPEC_STREAM_STOP;
+}
 
-  JsonObject data = doc.createNestedObject("data");
+void specStartInit(SpecPort &port) {
+  port.lineLength = 0;
+  specSetState(port, SPEC_INIT_SETTLE, sensorSerialSettleTime); // TODO: Sensor fails to init (once) at first boot (when the board is first plugged into power)
+}
 
-  // Klimerko itself
-  data["sent_at"]                        = timeClient.getFormattedDate();
-  data["device_fw"]                      = firmwareVersion;
-  data["device_active_time"]             = uptime_formatter::getUptime(); // esp_timer_get_time
-  data["device_wifi_rssi"]               = WiFi.RSSI();
-  data["device_free_heap"]               = ESP.getFreeHeap();
-  data["device_flash_size"]              = ESP.getFlashChipSize();
-  data["device_sketch_used"]             = ESP.getSketchSize();
-  data["device_sketch_total"]            = (ESP.getSketchSize() + ESP.getFreeSketchSpace());
-  data["device_last_successful_ota"]     = lastSuccessfulOTA;
-  data["device_last_failed_ota"]         = lastFailedOTA;
-  data["device_last_reset_reason"]       = resetReason;
-  data["device_sensor_read_interval"]    = sensorDataReadInterval;
-  data["device_sensor_publish_interval"] = sensorDataPublishInterval;
+void specStartRead(SpecPort &port) {
+  port.lineLength = 0;
+  port.serial->stream->write("\r"); // This is better than "c" because c causes continous output.
+  specSetState(port, SPEC_READ_WAIT, sensorSerialWaitTime);
+}
 
-  // SO2
-  data["so2_online"]              = so2SensorOnline;
-  data["so2_ready"]               = so2SensorReady;
-  data["so2_active_time"]         = so2SensorUptime;
-  data["so2_serial"]              = so2SerialNumber;
-  data["so2_fw_version"]          = so2Firmware;
-  data["so2_last_zeroing"]        = so2LastZeroing;
-  data["so2_last_failed_zeroing"] = so2LastFailedZeroing;
+void specStartStream(SpecPort &port) {
+  port.lineLength = 0;
+  stp("[");
+  stp(port.name);
+  stpln("] Starting continuous output...");
+  specDiscardInput(port);
+  port.serial->stream->write('c'); // Sensor keeps sending data lines until it receives another character
+  specSetState(port, SPEC_STREAM, specStreamTimeout);
+}
 
-  // NO2
-  data["no2_online"]              = no2SensorOnline;
-  data["no2_ready"]               = no2SensorReady;
-  data["no2_active_time"]         = no2SensorUptime;
-  data["no2_serial"]              = no2SerialNumber;
-  data["no2_fw_version"]          = so2Firmware;
-  data["no2_last_zeroing"]        = no2LastZeroing;
-  data["no2_last_failed_zeroing"] = no2LastFailedZeroing;
+void specStopStream(SpecPort &port) {
+  port.serial->stream->write("\r");
+  specSetState(port, SPEC_STREAM_STOP, sensorSerialDrainTime);
+}
 
-  // PMS
-  data["pms_online"]              = pmsSensorOnline;
+void specStartZero(SpecPort &port) {
+  port.zeroRequested = false;
+  port.lineLength = 0;
+  stp("[");
+  stp(port.name);
+  stpln("] Zeroing Sensor...");
+  specDiscardInput(port);
+  port.serial->stream->write('Z'); // Should give "\r\nSetting zero... done\r\n"
+  specSetState(port, SPEC_ZERO_WAIT_ECHO, sensorSerialWaitTime);
+}
 
-  serializeJson(doc, JSONmessageBuffer);
-  serializeJson(doc, Serial);
-  spln("");
+// Advances the transaction in progress on the port without blocking. Returns the event once a transaction completes.
+SpecEvent specPoll(SpecPort &port) {
+  if (port.state == SPEC_IDLE) {
+    if (port.zeroRequested) {
+      specStartZero(port);
+    }
+    return SPEC_EVENT_NONE;
+  }
 
-  if (mqtt.publish("v1/devices/actions", JSONmessageBuffer, true)) {
-    spln("[MQTT] Metadata sent!");
+  switch (port.state) {
+    case SPEC_INIT_SETTLE:
+      if (millis() - port.stateSince >= port.stateTimeout) {
+        specDiscardInput(port);
+        port.serial->stream->write("fw");
+        specSetState(port, SPEC_INIT_WAIT_FW, sensorSerialWaitTime);
+      }
+      break;
+
+    case SPEC_INIT_WAIT_FW:
+      if (specCollectLine(port, '\r')) {
+        stp("[");
+        stp(port.name);
+        stp("] Sensor Returned: ");
+        stp(port.line);
+        stp(", which is ");
+        stp(port.lineLength);
+        stp(" characters long. ");
+        if (port.lineLength == 7) {
+          stpln("Waking it up...");
+          specSetState(port, SPEC_INIT_WAKE, sensorSerialSettleTime);
+        } else {
+          stpln("Failed! Sensor didn't return the correct Firmware Version length.");
+          port.state = SPEC_IDLE;
+          return SPEC_EVENT_INIT_FAILED;
+        }
+      } else if (millis() - port.stateSince >= port.stateTimeout) {
+        stp("[");
+        stp(port.name);
+        stpln("] Failed to initialize! Sensor didn't reply in time.");
+        port.state = SPEC_IDLE;
+        return SPEC_EVENT_INIT_FAILED;
+      }
+      break;
+
+    case SPEC_INIT_WAKE:
+      if (millis() - port.stateSince >= port.stateTimeout) {
+        port.serial->stream->write("\r"); // Seems to be required so the sensor doesn't return an empty string on next read
+        specSetState(port, SPEC_INIT_DRAIN, sensorSerialDrainTime);
+      }
+      break;
+
+    case SPEC_INIT_DRAIN:
+      specDiscardInput(port);
+      if (millis() - port.stateSince >= port.stateTimeout) {
+        stp("[");
+        stp(port.name);
+        stpln("] Successfully initialized!");
+        port.state = SPEC_IDLE;
+        return SPEC_EVENT_INIT_OK;
+      }
+      break;
+
+    case SPEC_READ_WAIT:
+      if (specCollectLine(port, '\n')) {
+        port.state = SPEC_IDLE;
+        return SPEC_EVENT_READ_OK;
+      } else if (millis() - port.stateSince >= port.stateTimeout) {
+        port.state = SPEC_IDLE;
+        return SPEC_EVENT_READ_FAILED;
+      }
+      break;
+
+    case SPEC_STREAM:
+      if (port.zeroRequested) { // Sensor won't take commands while streaming
+        specStopStream(port);
+      } else if (specCollectLine(port, '\n')) {
+        port.lineLength = 0; // port.line stays intact until the next character arrives, so the line can still be read
+        port.stateTimeout = specStreamTimeout;
+        return SPEC_EVENT_READ_OK;
+      } else if (millis() - port.stateSince >= port.stateTimeout) {
+        port.state = SPEC_IDLE;
+        return SPEC_EVENT_READ_FAILED;
+      }
+      break;
+
+    case SPEC_STREAM_STOP:
+      specDiscardInput(port);
+      if (millis() - port.stateSince >= port.stateTimeout) {
+        port.state = SPEC_IDLE;
+      }
+      break;
+
+    case SPEC_ZERO_WAIT_ECHO:
+      if (specCollectLine(port, '\n')) {
+        stpln(port.line);
+        port.lineLength = 0;
+        specSetState(port, SPEC_ZERO_WAIT_RESULT, sensorSerialWaitTime);
+      } else if (millis() - port.stateSince >= port.stateTimeout) {
+        stp("[");
+        stp(port.name);
+        stpln("] Zeroing Failed. Sensor didn't reply in time.");
+        port.state = SPEC_IDLE;
+        return SPEC_EVENT_ZERO_FAILED;
+      }
+      break;
+
+    case SPEC_ZERO_WAIT_RESULT:
+      if (specCollectLine(port, '\n')) {
+        stpln(port.line);
+        port.state = SPEC_IDLE;
+        if (strcmp(port.line, "Setting zero...done\r") == 0) {
+          return SPEC_EVENT_ZERO_OK;
+        }
+        stp("[");
+        stp(port.name);
+        stpln("] Sensor Zeroing FAILED!");
+        return SPEC_EVENT_ZERO_FAILED;
+      } else if (millis() - port.stateSince >= port.stateTimeout) {
+        stp("[");
+        stp(port.name);
+        stpln("] Zeroing Failed. Sensor didn't reply in time.");
+        port.state = SPEC_IDLE;
+        return SPEC_EVENT_ZERO_FAILED;
+      }
+      break;
+
+    default:
+      break;
+  }
+  return SPEC_EVENT_NONE;
+}
+
+void sensorSerialAttach(SensorSerial &port, HardwareSerial &uart) {
+  SensorSerial *serial = &port;
+  port.hardware = &uart;
+  port.onError  = [serial](hardwareSerial_error_t error) { sensorSerialCountError(*serial, error); };
+}
+
+void sensorSerialAttach(SensorSerial &port, SoftwareSerial &uart) {
+  port.software = &uart;
+}
+
+template <typename Traits>
+GasSensor<Traits>::GasSensor() {
+  serial = { Traits::name, Traits::rxPin, Traits::txPin, Traits::baud, NULL, NULL, &uart };
+  sensorSerialAttach(serial, uart); // Picks the hardware or SoftwareSerial side by the type of 'uart'
+  port = { Traits::name, &serial };
+}
+
+template <typename Traits>
+void GasSensor<Traits>::readPersistantStorage() { // Preferences have to be opened by the caller
+  serialNumber      = preferences.getString(Traits::preferencesSerialNumber, preferences_SerialNumberDefault);
+  lastZeroing       = preferences.getString(Traits::preferencesLastZeroing, preferences_LastZeroingDefault);
+  lastFailedZeroing = preferences.getString(Traits::preferencesLastFailedZeroing, preferences_LastFailedZeroingDefault);
+}
+
+template <typename Traits>
+void GasSensor<Traits>::init() { // Completes in loop()
+  stp("[");
+  stp(Traits::name);
+  stpln("] Initializing...");
+  sensorSerialBegin(serial);
+  specStartInit(port);
+}
+
+template <typename Traits>
+void GasSensor<Traits>::initFinished(bool success) {
+  if (!success) {
+    online = false;
+    portENTER_CRITICAL(&sensorRecoveryLock);
+    sensorRecoveryFailed(recovery, millis(), esp_random());
+    portEXIT_CRITICAL(&sensorRecoveryLock);
+    stp("[");
+    stp(Traits::name);
+    stp("] Will check for availability again in ");
+    stp((recovery.nextAttempt - millis()) / 1000);
+    stpln(" seconds.");
+    return;
+  }
+  portENTER_CRITICAL(&sensorRecoveryLock);
+  sensorRecoverySucceeded(recovery, millis());
+  portEXIT_CRITICAL(&sensorRecoveryLock);
+  retryNumber = 0;
+  SensorEvent event = {};
+  event.type      = SENSOR_EVENT_ONLINE;
+  event.sensor    = Traits::id;
+  event.recovered = !online; // If the sensor was previously offline during operation, loop() sends metadata to update that it's online
+  strlcpy(event.firmware, port.line, sizeof event.firmware);
+  postSensorEvent(event);
+  if (!online) {
+    online = true;
+    read(); // Needs to read sensor data so that the sensor part of the metadata payload isn't empty
+  }
+}
+
+template <typename Traits>
+bool GasSensor<Traits>::read() {
+  if (SPEC_STREAMING && online && port.state == SPEC_STREAM) { // Streamed lines are handled as they arrive
+    return true;
+  }
+  if (specBusy(port)) {
+    stp("[");
+    stp(Traits::name);
+    stpln("] Previous request still in progress, skipping this read.");
+    return false;
+  }
+  if (retryNumber >= sensorRetriesBeforeConsideredOffline || !online) {
+    stp("[");
+    stp(Traits::name);
+    stpln("] Sensor seems to be offline. Trying to re-initialize it...");
+    sensorSerialEnd(serial);
+    if (online) {
+      online = false;
+      portENTER_CRITICAL(&sensorRecoveryLock);
+      sensorRecoveryStart(recovery, millis());
+      portEXIT_CRITICAL(&sensorRecoveryLock);
+      SensorEvent event = {};
+      event.type   = SENSOR_EVENT_OFFLINE;
+      event.sensor = Traits::id;
+      postSensorEvent(event); // loop() resets the averaging and sends metadata
+    }
+    init();
+    return false;
+  }
+  if (SPEC_STREAMING) {
+    specStartStream(port);
   } else {
-    spln("[MQTT] Metadata failed to send.");
+    specStartRead(port);
   }
+  return true;
 }
 
-void publishMetadataLoop() {
-  if (millis() - metadataLastPublish >= metadataPublishInterval * 1000) {
-    publishMetadata();
-    metadataLastPublish = millis();
+template <typename Traits>
+bool GasSensor<Traits>::readFinished(bool replied) { // Handles the reply to read() once the transaction completes
+  readCycleReplied(Traits::id);
+  if (!replied) {
+    retryNumber ++;
+    stp("[");
+    stp(Traits::name);
+    stp("] Couldn't get data this time. ");
+    stp(retryNumber);
+    stp("/");
+    stpln(sensorRetriesBeforeConsideredOffline);
+    return false;
+  }
+  SpecReading reading;
+  stp("[");
+  stp(Traits::name);
+  stp(" RAW]: ");
+  stpln(port.line);
+  SpecParseResult parseResult = specParseLine(port.line, reading);
+  if (parseResult != SPEC_PARSE_OK) {
+    stp("[");
+    stp(Traits::name);
+    stp("] Discarding invalid data: ");
+    stpln(specParseResultString(parseResult));
+    return false;
   }
 
-  if (!metadataPublishBootDone) {
-    if (millis() >= metadataPublishBootInterval * 1000) {
-      publishMetadata();
-      metadataPublishBootDone = true;
+  online = true;
+  retryNumber = 0;
+
+  SensorEvent event = {};
+  event.type   = SENSOR_EVENT_SAMPLE;
+  event.sensor = Traits::id;
+  event.spec   = reading;
+  postSensorEvent(event);
+  return true;
+}
+
+template <typename Traits>
+void GasSensor<Traits>::readLoop(unsigned long currentTime) {
+  uint32_t lineErrors = serial.framingErrors + serial.parityErrors;
+  if (online) { // Read the sensor if it's online. If it's considered offline, only check if it's available again when the recovery schedule says so
+    lineErrorsSeen = lineErrors;
+    read();
+  } else if (!specBusy(port)) {
+    if (serial.stream->available() || lineErrors != lineErrorsSeen) { // Something is on the line again, e.g. the sensor was plugged back in
+      specDiscardInput(port);
+      lineErrorsSeen = lineErrors;
+      if (!sensorRecoveryDue(recovery, currentTime)) {
+        stp("[");
+        stp(Traits::name);
+        stpln("] Activity on the port, checking for availability right away");
+        portENTER_CRITICAL(&sensorRecoveryLock);
+        sensorRecoveryWake(recovery, currentTime);
+        portEXIT_CRITICAL(&sensorRecoveryLock);
+      }
+    }
+    if (sensorRecoveryDue(recovery, currentTime)) {
+      portENTER_CRITICAL(&sensorRecoveryLock);
+      sensorRecoveryAttempted(recovery);
+      portEXIT_CRITICAL(&sensorRecoveryLock);
+      stp("[");
+      stp(Traits::name);
+      stp("] Now checking for availability, attempt ");
+      stpln(recovery.attempts);
+      read();
     }
   }
+  if (port.state == SPEC_READ_WAIT) {
+    readCyclePending |= 1 << Traits::id;
+  }
+}
+
+template <typename Traits>
+void GasSensor<Traits>::loop() {
+  SpecEvent event = specPoll(port);
+  SensorEvent zeroResult = {};
+  switch (event) {
+    case SPEC_EVENT_INIT_OK:
+    case SPEC_EVENT_INIT_FAILED:
+      initFinished(event == SPEC_EVENT_INIT_OK);
+      break;
+    case SPEC_EVENT_READ_OK:
+    case SPEC_EVENT_READ_FAILED:
+      readFinished(event == SPEC_EVENT_READ_OK);
+      break;
+    case SPEC_EVENT_ZERO_OK:
+    case SPEC_EVENT_ZERO_FAILED:
+      zeroResult.type   = event == SPEC_EVENT_ZERO_OK ? SENSOR_EVENT_ZERO_OK : SENSOR_EVENT_ZERO_FAILED;
+      zeroResult.sensor = Traits::id;
+      postSensorEvent(zeroResult); // loop() stores the zeroing result and sends metadata
+      break;
+    default:
+      break;
+  }
+}
+
+template <typename Traits>
+void GasSensor<Traits>::requestZero() { // Zeroing is done by the sensor task as soon as the sensor is free, the result comes back through handleEvent()
+  port.zeroRequested = true;
+}
+
+template <typename Traits>
+void GasSensor<Traits>::zeroFinished(bool success) {
+  preferences.begin("klimerko", false);
+  if (success) {
+    sp("[");
+    sp(Traits::name);
+    spln("] Sensor Succesfully Zeroed! Averaging Values Reset.");
+    // Reset the averaging since the values are going to be different now
+    resetAverages();
+    lastZeroing = timeClient.getFormattedDate();
+    preferences.putString(Traits::preferencesLastZeroing, lastZeroing);
+  } else {
+    lastFailedZeroing = timeClient.getFormattedDate();
+    preferences.putString(Traits::preferencesLastFailedZeroing, lastFailedZeroing);
+  }
+  preferences.end();
+  sp("[");
+  sp(Traits::name);
+  spln("] Zeroing Data Written to Persistant Storage.");
+  publishMetadata();
+  mqttCommandZeroFinished(Traits::id, success);
 }
 
-int ppb_to_ugm3(int value, int temperature, float molarMass) {
-  return (((float)value)*(12.187)*(molarMass))/(273.15+(float)temperature);
+template <typename Traits>
+void GasSensor<Traits>::eraseZeroing() { // Preferences have to be opened by the caller
+  preferences.putString(Traits::preferencesLastZeroing, preferences_LastZeroingDefault);
+  preferences.putString(Traits::preferencesLastFailedZeroing, preferences_LastFailedZeroingDefault);
+  lastZeroing       = preferences_LastZeroingDefault;
+  lastFailedZeroing = preferences_LastFailedZeroingDefault;
 }
 
-bool readSO2() {
-  if (so2SensorRetryNumber >= sensorRetriesBeforeConsideredOffline || !so2SensorOnline) {
-    spln("[SO2] Sensor seems to be offline. Trying to re-initialize it...");
-    so2Serial.end();
-    if (so2SensorOnline) {
-      so2SensorOnline = false;
+template <typename Traits>
+void GasSensor<Traits>::resetAverages() {
+  sensorFilter.reset(Traits::statsChannel, 3);
+  sensorStats.reset(Traits::statsChannel, 3);
+  sensorWindow.averages.reset(Traits::statsChannel, 3);
+  rollupWindow.averages.reset(Traits::statsChannel, 3);
+}
+
+template <typename Traits>
+void GasSensor<Traits>::windowClosed() {
+  if (!sensorWindow.averages.covered(Traits::statsChannel)) {
+    return;
+  }
+  averageConcentration = lroundf(sensorWindow.averages.mean(Traits::statsChannel) / 10);
+  averageTemperature   = lroundf(sensorWindow.averages.mean(Traits::statsChannel + 1));
+  averageHumidity      = lroundf(sensorWindow.averages.mean(Traits::statsChannel + 2));
+}
+
+template <typename Traits>
+void GasSensor<Traits>::handleEvent(const SensorEvent &event) { // Applies what the sensor task reported about this sensor
+  switch (event.type) {
+    case SENSOR_EVENT_SAMPLE:
+      handleSample(event.spec, event.time);
+      if (publishMetadataAfterRead) {
+        publishMetadataAfterRead = false;
+        publishMetadata();
+      }
+      break;
+
+    case SENSOR_EVENT_ONLINE:
+      firmware = event.firmware;
+      publishMetadataAfterRead = event.recovered;
+      break;
+
+    case SENSOR_EVENT_OFFLINE:
       // Reset the averaging since we don't know how long the sensor was offline
-      spln("[SO2] Averaging Values Reset Because the Sensor is Offline");
-      avgSo2.reset();
-      avgSo2Temp.reset();
-      avgSo2Hum.reset();
+      sp("[");
+      sp(Traits::name);
+      spln("] Averaging Values Reset Because the Sensor is Offline");
+      resetAverages();
       publishMetadata();
-    }
-    if (!initSO2()) {
-      return false;
-    }
+      break;
+
+    case SENSOR_EVENT_ZERO_OK:
+    case SENSOR_EVENT_ZERO_FAILED:
+      zeroFinished(event.type == SENSOR_EVENT_ZERO_OK);
+      break;
+
+    default:
+      break;
   }
-  String dataString, currentSerialNumber;
-  long dataArray[11];
-  so2Serial.write("\r"); // This is better than "c" because c causes continous output.
-  unsigned long sensorSerialWaitStart = millis();
-  while (!so2Serial.available()) {
-    if (millis() - sensorSerialWaitStart >= sensorSerialWaitTime) {
-      so2SensorRetryNumber ++;
-      sp("[SO2] Couldn't get data this time. ");
-      sp(so2SensorRetryNumber);
-      sp("/");
-      spln(sensorRetriesBeforeConsideredOffline);
-      return false;
-    }
+}
+
+template <typename Traits>
+void GasSensor<Traits>::handleSample(const SpecReading &reading, uint32_t time) {
+  currentConcentrationPPB    = reading.concentrationPPB;
+  currentTemperature         = reading.temperature + Traits::temperatureOffset;
+  currentHumidity            = reading.humidity + Traits::humidityOffset;
+  currentConcentrationADC    = reading.concentrationADC;
+  currentTemperatureDigital  = reading.temperatureDigital;
+  currentHumidityDigital     = reading.humidityDigital;
+
+  currentTemperatureTenths = gasTemperatureFromDigital(reading.temperatureDigital);
+  if (abs(currentTemperatureTenths - reading.temperature * 10) > 15) { // Raw reading doesn't match the reported temperature, don't trust it
+    currentTemperatureTenths = reading.temperature * 10;
   }
-  dataString = so2Serial.readStringUntil('\n');
-  currentSerialNumber = dataString.substring(0, dataString.indexOf(','));
-  sp("[SO2 RAW]: ");
-  spln(dataString);
-  for (int i = 0; i < 11; i++) {
-    String subS = dataString.substring(0, dataString.indexOf(','));
-    if (subS.length() == 0) return false;
-    dataArray[i] = subS.toInt();
-    dataString = dataString.substring(dataString.indexOf(',') + 2);
-  }
-
-  so2SensorOnline = true;
-  so2SensorRetryNumber = 0;
-
-  so2CurrentConcentrationPPB    = dataArray[1];
-  so2CurrentTemperature         = dataArray[2] - 2; // Temperature offset 
-  so2CurrentHumidity            = dataArray[3] - 1; // Humidity offset
-  so2CurrentConcentrationADC    = dataArray[4];
-  so2CurrentTemperatureDigital  = dataArray[5];
-  so2CurrentHumidityDigital     = dataArray[6];
-  so2SensorUptime_Days          = dataArray[7];
-  so2SensorUptime_Hours         = dataArray[8];
-  so2SensorUptime_Minutes       = dataArray[9];
-  so2SensorUptime_Seconds       = dataArray[10];
-
-  so2CurrentConcentration = ppb_to_ugm3(so2CurrentConcentrationPPB, so2CurrentTemperature, so2MolarMass);
-
-  so2AverageConcentration = avgSo2.reading(so2CurrentConcentration);
-  so2AverageTemperature   = avgSo2Temp.reading(so2CurrentTemperature);
-  so2AverageHumidity      = avgSo2Hum.reading(so2CurrentHumidity);
-
-  so2SensorUptime = String(so2SensorUptime_Days) + " days, " + String(so2SensorUptime_Hours) + " hours, " + String(so2SensorUptime_Minutes) + " minutes, " + String(so2SensorUptime_Seconds) + " seconds";
-  if (so2SensorUptime_Hours >= 3 || so2SensorUptime_Days > 0) {
-    so2SensorReady = true;
+  currentTemperatureTenths += Traits::temperatureOffset * 10;
+
+  currentConcentrationTenths = gasPpbToUgm3(currentConcentrationPPB, Traits::coefficient,
+                                            gasConversionAtAmbient ? currentTemperatureTenths : GAS_REFERENCE_TEMPERATURE,
+                                            gasConversionAtAmbient ? gasConversionPressure : GAS_STANDARD_PRESSURE);
+  currentConcentration       = gasRoundTenths(currentConcentrationTenths);
+
+  int32_t values[3] = { currentConcentrationTenths, currentTemperature, currentHumidity };
+  sensorFilterApply(Traits::statsChannel, values, 3);
+  sensorStats.add(Traits::statsChannel, values, 3);
+  sensorWindow.averages.add(Traits::statsChannel, time, values, 3, SPEC_STREAMING ? specStreamTimeout : sensorReadMaxHold());
+  rollupWindow.averages.add(Traits::statsChannel, time, values, 3, SPEC_STREAMING ? specStreamTimeout : sensorReadMaxHold());
+  averageConcentration = lroundf(sensorStats.mean(Traits::statsChannel) / 10); // Averaged in tenths, rounded only once
+  averageTemperature   = sensorStats.roundedMean(Traits::statsChannel + 1);
+  averageHumidity      = sensorStats.roundedMean(Traits::statsChannel + 2);
+
+  snprintf(uptime, sizeof uptime, "%d days, %d hours, %d minutes, %d seconds", reading.uptimeDays, reading.uptimeHours, reading.uptimeMinutes, reading.uptimeSeconds);
+  if (reading.uptimeHours >= 3 || reading.uptimeDays > 0) {
+    ready = true;
   } else {
-    so2SensorReady = false;
+    ready = false;
   }
 
-  if (currentSerialNumber.length() == 12) {
-    if (currentSerialNumber != so2SerialNumber) {
-      sp("[SO2] Sensor Seems to be changed! The Serial Number in memory is '");
-      sp(so2SerialNumber);
+  if (strlen(reading.serialNumber) == 12) {
+    if (serialNumber != reading.serialNumber) {
+      sp("[");
+      sp(Traits::name);
+      sp("] Sensor Seems to be changed! The Serial Number in memory is '");
+      sp(serialNumber);
       sp("' while the new one is '");
-      sp(currentSerialNumber);
+      sp(reading.serialNumber);
       spln("'. Writing change to memory and resetting Zeroing Information.");
-      so2SerialNumber = currentSerialNumber;
+      serialNumber = reading.serialNumber;
       preferences.begin("klimerko", false);
-      preferences.putString(preferences_so2SerialNumber, so2SerialNumber);
-      preferences.putString(preferences_so2LastZeroing, preferences_LastZeroingDefault);
-      preferences.putString(preferences_so2LastFailedZeroing, preferences_LastFailedZeroingDefault);
+      preferences.putString(Traits::preferencesSerialNumber, serialNumber);
+      preferences.putString(Traits::preferencesLastZeroing, preferences_LastZeroingDefault);
+      preferences.putString(Traits::preferencesLastFailedZeroing, preferences_LastFailedZeroingDefault);
       preferences.end();
       publishMetadata();
       // Reset the averages since it's a new sensor
-      avgSo2.reset();
-      avgSo2Temp.reset();
-      avgSo2Hum.reset();
+      resetAverages();
     }
   }
 
-  sp("[SO2 PARSED] S/N: ");
-  sp(so2SerialNumber);
+  sp("[");
+  sp(Traits::name);
+  sp(" PARSED] S/N: ");
+  sp(serialNumber);
   sp(", Conc (ug/m3): ");
-  sp(so2CurrentConcentration);
+  sp(currentConcentration);
   sp(", Conc Avg (ug/m3): ");
-  sp(so2AverageConcentration);
+  sp(averageConcentration);
   sp(", Conc (PPB): ");
-  sp(so2CurrentConcentrationPPB);
+  sp(currentConcentrationPPB);
   sp(", ADC: ");
-  sp(so2CurrentConcentrationADC);
+  sp(currentConcentrationADC);
   sp(", Temp: ");
-  sp(so2CurrentTemperature);
+  sp(currentTemperature);
   sp(", Temp Avg: ");
-  sp(so2AverageTemperature);
+  sp(averageTemperature);
   sp(", Hum: ");
-  sp(so2CurrentHumidity);
+  sp(currentHumidity);
   sp(", Hum Avg: ");
-  sp(so2AverageHumidity);
+  sp(averageHumidity);
   sp(", TempDigital: ");
-  sp(so2CurrentTemperatureDigital);
+  sp(currentTemperatureDigital);
   sp(", HumDigital: ");
-  sp(so2CurrentHumidityDigital);
+  sp(currentHumidityDigital);
   sp(", Online Since: ");
-  sp(so2SensorUptime_Days);
+  sp(reading.uptimeDays);
   sp(":");
-  sp(so2SensorUptime_Hours);
+  sp(reading.uptimeHours);
   sp(":");
-  sp(so2SensorUptime_Minutes);
+  sp(reading.uptimeMinutes);
   sp(":");
-  spln(so2SensorUptime_Seconds);
+  spln(reading.uptimeSeconds);
+}
 
-  return true;
+template <typename Traits>
+void GasSensor<Traits>::addMetadata(JsonObject data) {
+  char key[32]; // Keys are built from the traits' prefix, ArduinoJson copies them since they aren't constant
+  #define GAS_SENSOR_KEY(field) (snprintf(key, sizeof key, "%s_" field, Traits::key), key)
+  data[GAS_SENSOR_KEY("online")]              = (bool)online;
+  data[GAS_SENSOR_KEY("ready")]               = ready;
+  data[GAS_SENSOR_KEY("active_time")]         = uptime;
+  data[GAS_SENSOR_KEY("serial")]              = serialNumber;
+  data[GAS_SENSOR_KEY("fw_version")]          = firmware;
+  data[GAS_SENSOR_KEY("last_zeroing")]        = lastZeroing;
+  data[GAS_SENSOR_KEY("last_failed_zeroing")] = lastFailedZeroing;
+  data[GAS_SENSOR_KEY("uart")]                = serial.hardware ? "hardware" : "software";
+  data[GAS_SENSOR_KEY("uart_rx_bytes")]       = (uint32_t)serial.bytesReceived;
+  data[GAS_SENSOR_KEY("uart_framing_errors")] = (uint32_t)serial.framingErrors;
+  data[GAS_SENSOR_KEY("uart_parity_errors")]  = (uint32_t)serial.parityErrors;
+  data[GAS_SENSOR_KEY("uart_overflows")]      = (uint32_t)serial.overflows;
+  SensorRecovery current = sensorRecoveryRead(recovery);
+  data[GAS_SENSOR_KEY("recovery_attempts")]   = current.attempts;
+  data[GAS_SENSOR_KEY("recovery_successes")]  = current.successes;
+  data[GAS_SENSOR_KEY("offline_time")]        = sensorRecoveryOfflineSeconds(current, millis());
+  #undef GAS_SENSOR_KEY
 }
 
-bool readNO2() {
-  if (no2SensorRetryNumber >= sensorRetriesBeforeConsideredOffline || !no2SensorOnline) {
-    spln("[NO2] Sensor seems to be offline. Trying to re-initialize it...");
-    no2Serial.end();
-    if (no2SensorOnline) {
-      no2SensorOnline = false;
-      // Reset the averaging since we don't know how long the sensor was offline
-      spln("[NO2] Averaging Values Reset Because the Sensor is Offline");
-      avgNo2.reset();
-      avgNo2Temp.reset();
-      avgNo2Hum.reset();
-      publishMetadata();
+char* formatUtcTime(uint32_t epoch, char* buffer, size_t size, int milliseconds = -1) { // Same format as timeClient.getFormattedDate(), without building Strings
+  time_t    seconds = epoch;
+  struct tm utc;
+  gmtime_r(&seconds, &utc);
+  size_t length = strftime(buffer, size, "%Y-%m-%dT%H:%M:%S", &utc);
+  if (milliseconds >= 0) {
+    snprintf(buffer + length, size - length, ".%03dZ", milliseconds);
+  } else {
+    snprintf(buffer + length, size - length, "Z");
+  }
+  return buffer;
+}
+
+uint64_t sampleEpochMillis(int64_t timestamp) { // Epoch time of an esp_timer_get_time() timestamp, only meaningful once the clock is set
+  int64_t offset = (int64_t)timeClient.getEpochMillis() * 1000 - esp_timer_get_time(); // NTP time - monotonic time [microseconds]
+  return (timestamp + offset) / 1000;
+}
+
+void initMetadata() { // Collects the metadata fields that only change with a new firmware or a reboot (setup())
+  metadataStatic["device_fw"]                = firmwareVersion;
+  metadataStatic["device_flash_size"]        = ESP.getFlashChipSize();
+  metadataStatic["device_sketch_used"]       = ESP.getSketchSize();
+  metadataStatic["device_sketch_total"]      = (ESP.getSketchSize() + ESP.getFreeSketchSpace());
+  metadataStatic["device_last_reset_reason"] = resetReason;
+  metadataStatic["device_sensor_streaming"]  = (bool)SPEC_STREAMING;
+}
+
+bool metadataUntracked(const char* name) { // Fields that change all the time and wouldn't let a delta ever be empty
+  for (size_t i = 0; i < sizeof metadataUntrackedFields / sizeof metadataUntrackedFields[0]; i++) {
+    if (!strcmp(name, metadataUntrackedFields[i])) {
+      return true;
     }
-    if (!initNO2()) {
-      return false;
+  }
+  return false;
+}
+
+void publishMetadata(bool full) { // Sends the fields that changed since the last metadata, or all of them if 'full'
+  full = full || metadataFullPending;
+  sp(full ? "[DATA] Sending metadata to platform: " : "[DATA] Sending changed metadata to platform: ");
+  timeClient.update();
+
+  JsonObject fields = metadataSnapshot.to<JsonObject>();
+
+  // Klimerko itself
+  fields["device_active_time"]             = uptime_formatter::getUptime(); // esp_timer_get_time
+  fields["device_wifi_rssi"]               = WiFi.RSSI();
+  fields["device_free_heap"]               = ESP.getFreeHeap();
+  fields["device_last_successful_ota"]     = lastSuccessfulOTA;
+  fields["device_last_failed_ota"]         = lastFailedOTA;
+  fields["device_sensor_read_interval"]    = (int)sensorDataReadInterval;
+  fields["device_sensor_publish_interval"] = sensorDataPublishInterval;
+  fields["device_sensor_batch_size"]       = sensorBatchSize;
+  fields["device_read_cycle_latency"]      = readCycleLatencyLast;
+  fields["device_read_cycle_latency_avg"]  = readCycleCount ? readCycleLatencySum / readCycleCount : 0;
+  fields["device_read_cycle_latency_max"]  = readCycleLatencyMax;
+  fields["device_read_cycle_deadline_misses"] = readCycleDeadlineMisses;
+  fields["device_sensor_events_dropped"]   = sensorEventsDropped;
+
+  // SO2
+  so2.addMetadata(fields);
+
+  // NO2
+  no2.addMetadata(fields);
+
+  // PMS
+  fields["pms_online"]              = (bool)pmsSensorOnline;
+  SensorRecovery pmsRecovery       = sensorRecoveryRead(pmsSensorRecovery);
+  fields["pms_recovery_attempts"]   = pmsRecovery.attempts;
+  fields["pms_recovery_successes"]  = pmsRecovery.successes;
+  fields["pms_offline_time"]        = sensorRecoveryOfflineSeconds(pmsRecovery, millis());
+
+  // Store-and-forward
+  fields["device_store_pending"]          = readingStore.pending();
+  fields["device_store_high_water_mark"]  = readingStore.highWaterMark();
+  fields["device_store_dropped"]          = readingStore.dropped() + readingStoreLost;
+
+  // MQTT
+  fields["device_mqtt_in_flight"]         = mqttOutbox.inFlight();
+  fields["device_mqtt_resent"]            = mqttOutbox.resent();
+  fields["device_mqtt_resolve_time"]      = mqttPhaseTime[MQTT_PHASE_RESOLVE];
+  fields["device_mqtt_connect_time"]      = mqttPhaseTime[MQTT_PHASE_CONNECT];
+  fields["device_mqtt_handshake_time"]    = mqttPhaseTime[MQTT_PHASE_HANDSHAKE];
+  fields["device_mqtt_subscribe_time"]    = mqttPhaseTime[MQTT_PHASE_SUBSCRIBE];
+  if (mqttLastCommand) {
+    fields["device_last_command"]         = mqttLastCommand;
+    fields["device_last_command_latency"] = mqttLastCommandLatency;
+  }
+
+  // Outliers rejected since boot, per channel
+  for (uint8_t channel = 0; channel < STATS_CHANNEL_COUNT; channel++) {
+    char key[32];
+    snprintf(key, sizeof key, "%s_outliers", sensorChannels[channel].name);
+    fields[key] = sensorFilter.rejected(channel);
+  }
+  if (metadataSnapshot.overflowed()) { // Fields that didn't fit aren't tracked, so everything that did is sent
+    spln("[DATA] Metadata snapshot too small, fields were left out.");
+    full = true;
+  }
+
+  char sentAt[24];
+  formatUtcTime(timeClient.getEpochTime(), sentAt, sizeof sentAt);
+  JsonDocument &doc = publishDocument;
+  doc.clear();
+  doc["type"] = "device_metadata";
+  doc["client_id"] = MQTT_CLIENT_ID;
+  doc["correlation_id"] = MQTT_CLIENT_ID;
+  doc["sent_at"] = sentAt;
+  doc["delta"] = !full;
+
+  JsonObject data = doc.createNestedObject("data");
+  data["sent_at"] = sentAt;
+  if (full) {
+    for (JsonPairConst field : metadataStatic.as<JsonObjectConst>()) {
+      data[field.key().c_str()] = field.value();
     }
   }
-  String dataString, currentSerialNumber;
-  long dataArray[11];
-  no2Serial.write("\r"); // This is better than "c" because c causes continous output.
-  unsigned long sensorSerialWaitStart = millis();
-  while (!no2Serial.available()) {
-    if (millis() - sensorSerialWaitStart >= sensorSerialWaitTime) {
-      no2SensorRetryNumber ++;
-      sp("[NO2] Couldn't get data this time. ");
-      sp(no2SensorRetryNumber);
-      sp("/");
-      spln(sensorRetriesBeforeConsideredOffline);
-      return false;
+  uint8_t changed = 0;
+  for (JsonPair field : fields) {
+    if (metadataUntracked(field.key().c_str())) {
+      continue;
+    }
+    char value[64]; // Compared as text, long values only by their beginning
+    serializeJson(field.value(), value, sizeof value);
+    if (metadataFields.update(field.key().c_str(), value) || full) {
+      data[field.key().c_str()] = field.value(); // Key is linked, metadataSnapshot outlives the publish
+      changed++;
     }
   }
-  dataString = no2Serial.readStringUntil('\n');
-  currentSerialNumber = dataString.substring(0, dataString.indexOf(','));
-  sp("[NO2 RAW]: ");
-  spln(dataString);
-  for (int i = 0; i < 11; i++) {
-    String subS = dataString.substring(0, dataString.indexOf(','));
-    if (subS.length() == 0) return false;
-    dataArray[i] = subS.toInt();
-    dataString = dataString.substring(dataString.indexOf(',') + 2);
-  }
-
-  no2SensorOnline = true;
-  no2SensorRetryNumber = 0;
-
-  no2CurrentConcentrationPPB   = dataArray[1];
-  no2CurrentTemperature        = dataArray[2] - 2; // Offset
-  no2CurrentHumidity           = dataArray[3] - 1; // Offset
-  no2CurrentConcentrationADC   = dataArray[4];
-  no2CurrentTemperatureDigital = dataArray[5];
-  no2CurrentHumidityDigital    = dataArray[6];
-  no2SensorUptime_Days         = dataArray[7];
-  no2SensorUptime_Hours        = dataArray[8];
-  no2SensorUptime_Minutes      = dataArray[9];
-  no2SensorUptime_Seconds      = dataArray[10];
-
-  no2CurrentConcentration = ppb_to_ugm3(no2CurrentConcentrationPPB, no2CurrentTemperature, no2MolarMass);
-
-  no2AverageConcentration = avgNo2.reading(no2CurrentConcentration);
-  no2AverageTemperature   = avgNo2Temp.reading(no2CurrentTemperature);
-  no2AverageHumidity      = avgNo2Hum.reading(no2CurrentHumidity);
-
-  no2SensorUptime = String(no2SensorUptime_Days) + " days, " + String(no2SensorUptime_Hours) + " hours, " + String(no2SensorUptime_Minutes) + " minutes, " + String(no2SensorUptime_Seconds) + " seconds";
-  if (no2SensorUptime_Hours >= 3 || no2SensorUptime_Days > 0) {
-    no2SensorReady = true;
-  } else {
-    no2SensorReady = false;
+  if (!changed) {
+    spln("nothing changed.");
+    return;
+  }
+  for (JsonPair field : fields) { // Go along with anything that's sent
+    if (metadataUntracked(field.key().c_str())) {
+      data[field.key().c_str()] = field.value();
+    }
   }
 
-  if (currentSerialNumber.length() == 12) {
-    if (currentSerialNumber != no2SerialNumber) {
-      sp("[NO2] Sensor Seems to be changed! The Serial Number in memory is '");
-      sp(no2SerialNumber);
-      sp("' while the new one is '");
-      sp(currentSerialNumber);
-      spln("'. Writing change to memory and resetting Zeroing Information.");
-      no2SerialNumber = currentSerialNumber;
-      preferences.begin("klimerko", false);
-      preferences.putString(preferences_no2SerialNumber, no2SerialNumber);
-      preferences.putString(preferences_no2LastZeroing, preferences_LastZeroingDefault);
-      preferences.putString(preferences_no2LastFailedZeroing, preferences_LastFailedZeroingDefault);
-      preferences.end();
-      publishMetadata();
-      // Reset the averages since it's a new sensor
-      avgNo2.reset();
-      avgNo2Temp.reset();
-      avgNo2Hum.reset();
+  if (mqttPayloadEcho) {
+    serializeJson(doc, Serial);
+  }
+  spln("");
+
+  if (mqttPublishPayload("v1/devices/actions", doc, full)) { // Only full metadata is retained, so the retained message has every field
+    spln("[MQTT] Metadata sent!");
+    metadataFields.commit();
+    if (full) {
+      metadataFullPending = false;
+      metadataLastFull    = millis();
+    }
+    // Average and maximum read cycle latency are reported for the time since the last metadata
+    readCycleCount      = 0;
+    readCycleLatencySum = 0;
+    readCycleLatencyMax = 0;
+  } else {
+    spln("[MQTT] Metadata failed to send.");
+    if (full) {
+      metadataFullPending = true; // The broker may not have the retained snapshot the next deltas would be based on
     }
   }
+}
 
-  sp("[NO2 PARSED] S/N: ");
-  sp(no2SerialNumber);
-  sp(", Conc (ug/m3): ");
-  sp(no2CurrentConcentration);
-  sp(", Conc Avg (ug/m3): ");
-  sp(no2AverageConcentration);
-  sp(", Conc (PPB): ");
-  sp(no2CurrentConcentrationPPB);
-  sp(", ADC: ");
-  sp(no2CurrentConcentrationADC);
-  sp(", Temp: ");
-  sp(no2CurrentTemperature);
-  sp(", Temp Avg: ");
-  sp(no2AverageTemperature);
-  sp(", Hum: ");
-  sp(no2CurrentHumidity);
-  sp(", Hum Avg: ");
-  sp(no2AverageHumidity);
-  sp(", TempDigital: ");
-  sp(no2CurrentTemperatureDigital);
-  sp(", HumDigital: ");
-  sp(no2CurrentHumidityDigital);
-  sp(", Online Since: ");
-  sp(no2SensorUptime_Days);
-  sp(":");
-  sp(no2SensorUptime_Hours);
-  sp(":");
-  sp(no2SensorUptime_Minutes);
-  sp(":");
-  spln(no2SensorUptime_Seconds);
+void publishMetadataLoop() {
+  if (millis() - metadataLastPublish >= metadataPublishInterval * 1000) {
+    publishMetadata(millis() - metadataLastFull >= metadataFullInterval * 1000UL);
+    metadataLastPublish = millis();
+  }
 
-  return true;
+  if (!metadataPublishBootDone) {
+    if (millis() >= metadataPublishBootInterval * 1000) {
+      publishMetadata();
+      metadataPublishBootDone = true;
+    }
+  }
 }
 
 bool readPMS() {
   pms.read();
   if (pms) {
+    SensorEvent event = {};
     if (pmsSensorRetryNumber >= sensorRetriesBeforeConsideredOffline && !pmsSensorOnline) {
-      spln("[PMS] The sensor is back online!");
+      stpln("[PMS] The sensor is back online!");
       pmsSensorOnline = true;
-      publishMetadata();
+      portENTER_CRITICAL(&sensorRecoveryLock);
+      sensorRecoverySucceeded(pmsSensorRecovery, millis());
+      portEXIT_CRITICAL(&sensorRecoveryLock);
+      event.type      = SENSOR_EVENT_ONLINE;
+      event.sensor    = SENSOR_PMS;
+      event.recovered = true;
+      postSensorEvent(event); // loop() sends metadata
     }
 
-    pm1Current   = pms.pm01;
-    pm2_5Current = pms.pm25;
-    pm10Current  = pms.pm10;
-
-    pm1Average   = avgPM1.reading(pm1Current);
-    pm2_5Average = avgPM25.reading(pm2_5Current);
-    pm10Average  = avgPM10.reading(pm10Current);
-
-    sp("[PMS] PM 1: ");
-    sp(pm1Current);
-    sp(", PM 1 Avg: ");
-    sp(pm1Average);
-    sp(", PM 2.5: ");
-    sp(pm2_5Current);
-    sp(", PM 2.5 Avg: ");
-    sp(pm2_5Average);
-    sp(", PM 10: ");
-    sp(pm10Current);
-    sp(", PM 10 Avg: ");
-    spln(pm10Average);
+    event.type   = SENSOR_EVENT_SAMPLE;
+    event.sensor = SENSOR_PMS;
+    event.pm01   = pms.pm01;
+    event.pm25   = pms.pm25;
+    event.pm10   = pms.pm10;
+    postSensorEvent(event);
 
     pmsSensorRetryNumber = 0; // Must be here in case the sensor reconnects before its considered offline
     pmsSensorOnline = true;
     return true;
   } else { // Something went wrong
-    pmsSensorRetryNumber++;
-    sp("[PMS] Couldn't get data this time. ");
-    sp(pmsSensorRetryNumber);
-    sp("/");
-    sp(sensorRetriesBeforeConsideredOffline);
-    sp(", Reason: ");
+    if (pmsSensorRetryNumber < sensorRetriesBeforeConsideredOffline) { // Stop counting once offline so it can't overflow
+      pmsSensorRetryNumber++;
+    }
+    stp("[PMS] Couldn't get data this time. ");
+    stp(pmsSensorRetryNumber);
+    stp("/");
+    stp(sensorRetriesBeforeConsideredOffline);
+    stp(", Reason: ");
 
     switch (pms.status) {
       case pms.OK: // Should never come here
         break;
       case pms.ERROR_TIMEOUT:
-        spln(F(PMS_ERROR_TIMEOUT));
+        stpln(F(PMS_ERROR_TIMEOUT));
         break;
       case pms.ERROR_MSG_UNKNOWN:
-        spln(F(PMS_ERROR_MSG_UNKNOWN));
+        stpln(F(PMS_ERROR_MSG_UNKNOWN));
         break;
       case pms.ERROR_MSG_HEADER:
-        spln(F(PMS_ERROR_MSG_HEADER));
+        stpln(F(PMS_ERROR_MSG_HEADER));
         break;
       case pms.ERROR_MSG_BODY:
-        spln(F(PMS_ERROR_MSG_BODY));
+        stpln(F(PMS_ERROR_MSG_BODY));
         break;
       case pms.ERROR_MSG_START:
-        spln(F(PMS_ERROR_MSG_START));
+        stpln(F(PMS_ERROR_MSG_START));
         break;
       case pms.ERROR_MSG_LENGTH:
-        spln(F(PMS_ERROR_MSG_LENGTH));
+        stpln(F(PMS_ERROR_MSG_LENGTH));
         break;
       case pms.ERROR_MSG_CKSUM:
-        spln(F(PMS_ERROR_MSG_CKSUM));
+        stpln(F(PMS_ERROR_MSG_CKSUM));
         break;
       case pms.ERROR_PMS_TYPE:
-        spln(F(PMS_ERROR_PMS_TYPE));
+        stpln(F(PMS_ERROR_PMS_TYPE));
         break;
       }
 
     if (pmsSensorRetryNumber >= sensorRetriesBeforeConsideredOffline) {
-      spln("[PMS] The sensor seems to be offline!");
+      stpln("[PMS] The sensor seems to be offline!");
+      portENTER_CRITICAL(&sensorRecoveryLock);
+      sensorRecoveryFailed(pmsSensorRecovery, millis(), esp_random());
+      portEXIT_CRITICAL(&sensorRecoveryLock);
       if (pmsSensorOnline) {
-        // Reset the averages since we don't know how long the sensor was offline
-        spln("[PMS] Averaging Data Reset Because Sensor is Offline.");
-        avgPM1.reset();
-        avgPM25.reset();
-        avgPM10.reset();
         pmsSensorOnline = false;
-        publishMetadata();
+        SensorEvent event = {};
+        event.type   = SENSOR_EVENT_OFFLINE;
+        event.sensor = SENSOR_PMS;
+        postSensorEvent(event); // loop() resets the averaging and sends metadata
       }
     }
 
@@ -807,260 +1697,570 @@ bool readPMS() {
   }
 }
 
-bool zeroSO2() {
-  String commandString;
-  spln("[SO2] Zeroing Sensor...");
-  unsigned long sensorSerialWaitStart = millis();
-  while (so2Serial.available()) {
-    so2Serial.read();
-    if (millis() - sensorSerialWaitStart >= sensorSerialWaitTime) {
-      spln("[SO2] Zeroing Failed. Sensor didn't reply in time.");
-      return false;
+void zeroSensors(String sensor) { // Zeroing is done by the sensor task as soon as the sensor is free, the result comes back through processSensorEvents()
+  if (sensor == "SO2") {
+    so2.requestZero();
+  } else if (sensor == "NO2") {
+    no2.requestZero();
+  } else if (sensor == "ALL") {
+    so2.requestZero();
+    no2.requestZero();
+  } else {
+    spln("Wrong parameter used for 'zeroSensor(String)'");
+  }
+}
+
+void publishSensorDataSpread(JsonObject data, const char* name, uint8_t channel, float scale) { // Adds what's behind an averaged value
+  if (!sensorStats.count(channel)) {
+    return;
+  }
+  char key[24]; // ArduinoJson copies these keys since they aren't constant
+  snprintf(key, sizeof key, "%s_min", name);
+  data[key] = sensorStats.minimum(channel) * scale;
+  snprintf(key, sizeof key, "%s_max", name);
+  data[key] = sensorStats.maximum(channel) * scale;
+  snprintf(key, sizeof key, "%s_sd", name);
+  data[key] = roundf(sensorStats.stddev(channel) * scale * 10) / 10;
+  snprintf(key, sizeof key, "%s_n", name);
+  data[key] = sensorStats.count(channel);
+}
+
+bool sensorReadingAvailable(bool online, uint8_t channel) { // Sensor has averages to publish
+  return online && (!sensorWindow.active || sensorWindow.averages.covered(channel));
+}
+
+void sensorReadingTake(SensorReading &reading) { // Takes the current averages (loop())
+  memset(&reading, 0, sizeof reading);
+  reading.time = timeClient.getEpochTime();
+  if (sensorLastSampleTimestamp && reading.time >= wallClockValidEpoch) {
+    uint64_t sampledAt      = sampleEpochMillis(sensorLastSampleTimestamp);
+    reading.flags          |= READING_SAMPLED;
+    reading.sampledAt       = sampledAt / 1000;
+    reading.sampledAtMillis = sampledAt % 1000;
+  }
+  if (sensorWindow.active) {
+    reading.flags       |= READING_WINDOW;
+    reading.windowStart  = sensorWindow.startEpoch;
+    reading.windowLength = sensorWindow.length;
+    reading.so2Coverage  = sensorWindow.averages.coverage(STATS_SO2);
+    reading.no2Coverage  = sensorWindow.averages.coverage(STATS_NO2);
+    reading.pmsCoverage  = sensorWindow.averages.coverage(STATS_PM1);
+  }
+
+  if (sensorReadingAvailable(so2.online, STATS_SO2)) {
+    reading.flags  |= READING_SO2 | (so2.ready ? READING_SO2_READY : 0);
+    reading.so2     = so2.averageConcentration;
+    reading.so2Adc  = so2.currentConcentrationADC;
+  } else {
+    spln("[DATA] Won't publish SO2 data since the sensor is offline.");
+  }
+
+  if (sensorReadingAvailable(no2.online, STATS_NO2)) {
+    reading.flags  |= READING_NO2 | (no2.ready ? READING_NO2_READY : 0);
+    reading.no2     = no2.averageConcentration;
+    reading.no2Adc  = no2.currentConcentrationADC;
+  } else {
+    spln("[DATA] Won't publish NO2 data since the sensor is offline.");
+  }
+
+  if (sensorReadingAvailable(pmsSensorOnline, STATS_PM1)) {
+    reading.flags  |= READING_PMS;
+    reading.pm1     = pm1Average;
+    reading.pm2_5   = pm2_5Average;
+    reading.pm10    = pm10Average;
+  } else {
+    spln("[DATA] Won't publish PMS data since the sensor is offline.");
+  }
+
+  if (sensorReadingAvailable(no2.online, STATS_NO2_TEMPERATURE)) {
+    reading.flags       |= READING_CLIMATE;
+    reading.temperature  = no2.averageTemperature;
+    reading.humidity     = no2.averageHumidity;
+  } else if (sensorReadingAvailable(so2.online, STATS_SO2_TEMPERATURE)) {
+    spln("[DATA] Using SO2 Temperature & Humidity data because NO2 is offline.");
+    reading.flags       |= READING_CLIMATE | READING_CLIMATE_SO2;
+    reading.temperature  = so2.averageTemperature;
+    reading.humidity     = so2.averageHumidity;
+  } else {
+    spln("[DATA] Won't publish Temperature & Humidity data - both SO2 and NO2 are offline.");
+  }
+}
+
+JsonObject sensorReadingToJson(const SensorReading &reading, JsonObject doc) { // Payload common to live, batched and stored readings, returns "data"
+  char date[24]; // ArduinoJson copies these values since they aren't constant
+  doc["sent_at"] = formatUtcTime(reading.time, date, sizeof date);
+  if (reading.flags & READING_SAMPLED) {
+    doc["sampled_at"] = formatUtcTime(reading.sampledAt, date, sizeof date, reading.sampledAtMillis);
+  }
+  if (reading.flags & READING_WINDOW) {
+    doc["window_start"] = formatUtcTime(reading.windowStart, date, sizeof date);
+    doc["window_end"]   = formatUtcTime(reading.windowStart + reading.windowLength, date, sizeof date);
+  }
+  JsonObject data = doc.createNestedObject("data");
+
+  if (reading.flags & READING_SO2) {
+    data["SO2"]             = reading.so2;
+    data["so2_adc"]         = reading.so2Adc;
+    data["so2_ready"]       = (bool)(reading.flags & READING_SO2_READY);
+    if (reading.flags & READING_WINDOW) {
+      data["so2_coverage"]  = reading.so2Coverage;
     }
   }
-  so2Serial.flush();
-  so2Serial.write('Z');
-  // Should give "\r\nSetting zero... done\r\n"
-  sensorSerialWaitStart = millis();
-  while (!so2Serial.available()) {
-    if (millis() - sensorSerialWaitStart >= sensorSerialWaitTime) {
-      spln("[SO2] Zeroing Failed. Sensor didn't reply in time.");
-      return false;
+
+  if (reading.flags & READING_NO2) {
+    data["NO2"]             = reading.no2;
+    data["no2_adc"]         = reading.no2Adc;
+    data["no2_ready"]       = (bool)(reading.flags & READING_NO2_READY);
+    if (reading.flags & READING_WINDOW) {
+      data["no2_coverage"]  = reading.no2Coverage;
     }
   }
-  commandString = so2Serial.readStringUntil('\n');
-  spln(commandString);
-  delay(10);
-  sensorSerialWaitStart = millis();
-  while (!so2Serial.available()) {
-    if (millis() - sensorSerialWaitStart >= sensorSerialWaitTime) {
-      spln("[SO2] Zeroing Failed. Sensor didn't reply in time.");
-      return false;
+
+  if (reading.flags & READING_PMS) {
+    data["PM1"]             = reading.pm1;
+    data["PM2_5"]           = reading.pm2_5;
+    data["PM10"]            = reading.pm10;
+    if (reading.flags & READING_WINDOW) {
+      data["pms_coverage"]  = reading.pmsCoverage;
     }
   }
-  commandString = so2Serial.readStringUntil('\n');
-  spln(commandString); 
-  
-  if (commandString == "Setting zero...done\r") {
-    spln("[SO2] Sensor Succesfully Zeroed! Averaging Values Reset.");
-    // Reset the averaging since the values are going to be different now
-    avgSo2.reset();
-    avgSo2Temp.reset();
-    avgSo2Hum.reset();
-    return true;
-  } else {
-    spln("[SO2] Sensor Zeroing FAILED!");
+
+  if (reading.flags & READING_CLIMATE) {
+    data["temperature"]     = reading.temperature;
+    data["humidity"]        = reading.humidity;
   }
-  return false;
+  return data;
 }
 
-bool zeroNO2() {
-  String commandString;
-  spln("[NO2] Zeroing Sensor...");
-  unsigned long sensorSerialWaitStart = millis();
-  while (no2Serial.available()) {
-    no2Serial.read();
-    if (millis() - sensorSerialWaitStart >= sensorSerialWaitTime) {
-      spln("[NO2] Zeroing Failed. Sensor didn't reply in time.");
-      return false;
+void publishSensorDataRollups(JsonObject data) { // Adds the rollups that are covered well enough and the air quality index computed from them
+  uint8_t     aqi          = 0;
+  const char* aqiPollutant = NULL;
+  char        key[24]; // ArduinoJson copies these keys since they aren't constant
+  for (uint8_t i = 0; i < AQI_POLLUTANT_COUNT; i++) {
+    const AqiSource &source = aqiSources[i];
+    for (uint8_t level = ROLLUP_15M; level < ROLLUP_LEVEL_COUNT; level++) { // A minute is already covered by the regular averages
+      if (sensorRollup.coverage((RollupLevel)level, source.channel) >= rollupMinCoverage) {
+        snprintf(key, sizeof key, "%s_%s", source.name, rollupNames[level]);
+        data[key] = lroundf(sensorRollup.mean((RollupLevel)level, source.channel) * source.scale);
+      }
+    }
+    if (sensorRollup.coverage(source.level, source.channel) >= rollupMinCoverage) {
+      uint8_t level = aqiLevel(source.pollutant, sensorRollup.mean(source.level, source.channel) * source.scale);
+      if (level > aqi) {
+        aqi          = level;
+        aqiPollutant = source.name;
+      }
+    }
+  }
+  if (aqi) {
+    data["aqi"]           = aqi;
+    data["aqi_pollutant"] = aqiPollutant;
+  }
+}
+
+void initReadingStore() {
+  readingStorage.partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, NULL);
+  if (!readingStorage.partition || readingStorage.partition->size < readingStoreSectors * RECORD_RING_SECTOR_SIZE) {
+    spln("[STORE] No data partition for storing unsent readings, they will be lost while offline.");
+    return;
+  }
+  if (!readingStore.begin(readingStoreSectors)) {
+    spln("[STORE] Data partition held something other than stored readings, erased it.");
+  }
+  sp("[STORE] Ready, ");
+  sp(readingStore.pending());
+  sp(" of ");
+  sp(readingStore.capacity());
+  spln(" stored readings waiting to be sent.");
+}
+
+void readingStorePush(const SensorReading &reading) {
+  if (timeClient.getEpochTime() < wallClockValidEpoch) { // Couldn't be placed in time later
+    spln("[STORE] Reading not stored, the clock isn't set yet.");
+    readingStoreLost++;
+    return;
+  }
+  if (!readingStore.push(reading)) {
+    spln("[STORE] Failed to store the reading.");
+    readingStoreLost++;
+  }
+}
+
+void readingStoreLoop() { // Sends the stored readings one by one, oldest first (loop())
+  if (!readingStore.pending() || !mqttReady() || mqttOutbox.full() || millis() - readingStoreLastDrain < readingStoreDrainInterval) {
+    return;
+  }
+  readingStoreLastDrain = millis();
+  SensorReading reading;
+  if (!readingStore.peek(reading)) {
+    return;
+  }
+  JsonDocument &doc = publishDocument;
+  sensorReadingToJson(reading, doc.to<JsonObject>());
+  doc["client_id"] = MQTT_CLIENT_ID;
+  doc["stored"] = true; // Sent late, "sent_at" is when it was taken
+
+  char topic[128];
+  snprintf(topic, sizeof topic, "%s%s%s", "v1/devices/", MQTT_CLIENT_ID, "/actions/ingest");
+  if (mqttPublishPayload(topic, doc, false, mqttSensorDataQos)) { // Not retained, the retained message stays the newest reading
+    readingStore.pop();
+    sp("[STORE] Stored reading sent, ");
+    sp(readingStore.pending());
+    spln(" left.");
+  }
+}
+
+void publishSensorDataExtras(JsonObject data, const SensorReading &reading) { // What's only sent live, with the newest reading
+  if (sensorDataPublishSpread) {
+    if (reading.flags & READING_SO2) {
+      publishSensorDataSpread(data, "SO2", STATS_SO2, 0.1);
+    }
+    if (reading.flags & READING_NO2) {
+      publishSensorDataSpread(data, "NO2", STATS_NO2, 0.1);
     }
+    if (reading.flags & READING_PMS) {
+      publishSensorDataSpread(data, "PM1", STATS_PM1, 1);
+      publishSensorDataSpread(data, "PM2_5", STATS_PM2_5, 1);
+      publishSensorDataSpread(data, "PM10", STATS_PM10, 1);
+    }
+    if (reading.flags & READING_CLIMATE) {
+      bool fromSO2 = reading.flags & READING_CLIMATE_SO2;
+      publishSensorDataSpread(data, "temperature", fromSO2 ? STATS_SO2_TEMPERATURE : STATS_NO2_TEMPERATURE, 1);
+      publishSensorDataSpread(data, "humidity", fromSO2 ? STATS_SO2_HUMIDITY : STATS_NO2_HUMIDITY, 1);
+    }
+  }
+
+  publishSensorDataRollups(data);
+}
+
+void publishSensorBatch() { // Sends the readings taken so far in one message, as many of them as fit sensorBatchMaxBytes (loop())
+  JsonDocument &doc = publishDocument;
+  uint8_t count = 0;
+  if (sensorBatchCount == 1) { // Same message as without batching
+    JsonObject data = sensorReadingToJson(sensorBatch[0], doc.to<JsonObject>());
+    doc["client_id"] = MQTT_CLIENT_ID;
+    publishSensorDataExtras(data, sensorBatch[0]);
+    count = 1;
+  } else {
+    char sentAt[24];
+    doc.clear();
+    doc["sent_at"]   = formatUtcTime(timeClient.getEpochTime(), sentAt, sizeof sentAt);
+    doc["client_id"] = MQTT_CLIENT_ID;
+    // Added first, so they always fit: they're about this interval and don't go to storage with the readings
+    publishSensorDataExtras(doc.createNestedObject("data"), sensorBatch[sensorBatchCount - 1]);
+    JsonArray readings = doc.createNestedArray("readings");
+    for (; count < sensorBatchCount; count++) {
+      sensorReadingToJson(sensorBatch[count], readings.createNestedObject());
+      if (count > 0 && measureJson(doc) > sensorBatchMaxBytes) { // Doesn't fit, it's sent with the next message
+        readings.remove(count);
+        break;
+      }
+    }
+  }
+
+  sp("[DATA] Sending Sensor Data: ");
+  if (mqttPayloadEcho) {
+    serializeJson(doc, Serial);
+  }
+  spln("");
+
+  // v1.devices.{deviceId}.actions.ingest
+  char topic[128];
+  snprintf(topic, sizeof topic, "%s%s%s", "v1/devices/", MQTT_CLIENT_ID, "/actions/ingest");
+
+  if (mqttPublishPayload(topic, doc, true, mqttSensorDataQos)) {
+    spln("[MQTT] Sensor data sent!");
+  } else {
+    spln("[MQTT] Sensor data failed to send, storing it to be sent later.");
+    for (uint8_t i = 0; i < count; i++) {
+      readingStorePush(sensorBatch[i]);
+    }
+  }
+  sensorBatchCount -= count;
+  memmove(&sensorBatch[0], &sensorBatch[count], sensorBatchCount * sizeof(SensorReading));
+}
+
+void publishSensorData() {
+  SensorReading reading;
+  sensorReadingTake(reading);
+  if (sensorBatchCount == sensorBatchMax) { // Only if the byte budget keeps holding readings back, the oldest goes to storage
+    readingStorePush(sensorBatch[0]);
+    sensorBatchCount--;
+    memmove(&sensorBatch[0], &sensorBatch[1], sensorBatchCount * sizeof(SensorReading));
+  }
+  sensorBatch[sensorBatchCount++] = reading;
+  if (sensorBatchCount >= sensorBatchSize) {
+    publishSensorBatch();
+  } else {
+    sp("[DATA] Sensor data batched, ");
+    sp(sensorBatchCount);
+    sp(" of ");
+    sp(sensorBatchSize);
+    spln(" readings.");
+  }
+  sensorStats.reset(); // Every publish covers the samples since the previous one
+}
+
+void sensorSerialDataReceived() { // Called from the UART driver's event task
+  if (sensorTaskHandle) {
+    xTaskNotifyGive(sensorTaskHandle);
+  }
+}
+
+void postSensorEvent(SensorEvent &event) { // Sensor task only
+  event.timestamp = esp_timer_get_time();
+  event.time      = event.timestamp / 1000; // Same clock as millis()
+  if (!sensorEvents.push(event)) {
+    sensorEventsDropped++;
+    stpln("[SENSORS] Event queue is full, event dropped!");
+  }
+}
+
+void readCycleClose(bool deadlineMissed) { // Sensor task
+  SensorEvent event = {};
+  event.type           = SENSOR_EVENT_READ_CYCLE;
+  event.cycleLatency   = millis() - readCycleStart;
+  event.deadlineMissed = deadlineMissed;
+  readCyclePending     = 0;
+  stp("[DATA] Read cycle took ");
+  stp(event.cycleLatency);
+  stpln(deadlineMissed ? " ms (deadline missed)" : " ms");
+  postSensorEvent(event);
+}
+
+void readCycleReplied(SensorId sensor) { // Sensor task, called once a sensor polled in the current cycle replied or timed out
+  if (!(readCyclePending & (1 << sensor))) { // Not part of an open cycle (e.g. a streamed line or the read after a recovery)
+    return;
+  }
+  readCyclePending &= ~(1 << sensor);
+  if (!readCyclePending) {
+    readCycleClose(false);
+  }
+}
+
+void readCycleLoop() { // Closes the read cycle if a sensor is taking too long (sensor task)
+  if (readCyclePending && millis() - readCycleStart >= readCycleDeadline) {
+    readCycleClose(true);
+  }
+}
+
+void sensorReadLoop() { // Reads the sensors every sensorDataReadInterval (sensor task)
+  unsigned long currentTime = millis();
+  unsigned long interval    = sensorDataReadInterval * 1000; // Can be changed by loop() at any time
+  if (currentTime - sensorDataLastRead < interval) {
+    return;
+  }
+  // Schedule the next read from when this one was due rather than from now, so the read cadence doesn't drift
+  sensorDataLastRead += interval;
+  if (currentTime - sensorDataLastRead >= interval) { // Fell behind by a whole interval, don't try to catch up
+    sensorDataLastRead = currentTime;
   }
-  no2Serial.flush();
-  no2Serial.write('Z');
-  // Should give "\r\nSetting zero... done\r\n"
-  sensorSerialWaitStart = millis();
-  while (!no2Serial.available()) {
-    if (millis() - sensorSerialWaitStart >= sensorSerialWaitTime) {
-      spln("[NO2] Zeroing Failed. Sensor didn't reply in time.");
-      return false;
-    }
+  stpln("[DATA] Reading Sensor Data...");
+  if (readCyclePending) { // Only possible if the read interval is shorter than the deadline
+    readCycleClose(true);
   }
-  commandString = no2Serial.readStringUntil('\n');
-  spln(commandString);
-  delay(10);
-  sensorSerialWaitStart = millis();
-  while (!no2Serial.available()) {
-    if (millis() - sensorSerialWaitStart >= sensorSerialWaitTime) {
-      spln("[NO2] Zeroing Failed. Sensor didn't reply in time.");
-      return false;
+  // SO2 and NO2 requests are only sent here, their replies are collected by so2.loop() and no2.loop() while PMS is being read
+  readCycleStart = currentTime;
+  so2.readLoop(currentTime);
+  no2.readLoop(currentTime);
+  readCyclePending |= 1 << SENSOR_PMS;
+
+  if (pmsSensorOnline) { // Read the sensor if it's online. If it's considered offline, only check if it's available again when the recovery schedule says so
+    readPMS();
+  } else if (sensorRecoveryDue(pmsSensorRecovery, currentTime)) {
+    portENTER_CRITICAL(&sensorRecoveryLock);
+    sensorRecoveryAttempted(pmsSensorRecovery);
+    portEXIT_CRITICAL(&sensorRecoveryLock);
+    stp("[PMS] Now checking for availability, attempt ");
+    stpln(pmsSensorRecovery.attempts);
+    readPMS();
+    if (!pmsSensorOnline) {
+      stp("[PMS] Will check for availability again in ");
+      stp((pmsSensorRecovery.nextAttempt - millis()) / 1000);
+      stpln(" seconds.");
     }
   }
-  commandString = no2Serial.readStringUntil('\n');
-  spln(commandString); 
-  
-  if (commandString == "Setting zero...done\r") {
-    spln("[NO2] Sensor Succesfully Zeroed! Averaging Values Reset.");
-    // Reset the averaging since the values are going to be different now
-    avgNo2.reset();
-    avgNo2Temp.reset();
-    avgNo2Hum.reset();
-    return true;
-  } else {
-    spln("[NO2] Sensor Zeroing FAILED!");
-  }
-  return false;
+  readCycleReplied(SENSOR_PMS); // PMS is read synchronously, so it's done either way
 }
 
-void zeroSensors(String sensor) {
-  if (sensor == "SO2") {
-    if (zeroSO2()) {
-      so2LastZeroing = timeClient.getFormattedDate();
-      preferences.begin("klimerko", false);
-      preferences.putString(preferences_so2LastZeroing, so2LastZeroing);
-      preferences.end();
-    } else {
-      so2LastFailedZeroing = timeClient.getFormattedDate();
-      preferences.begin("klimerko", false);
-      preferences.putString(preferences_so2LastFailedZeroing, so2LastFailedZeroing);
-      preferences.end();
-    }
-  } else if (sensor == "NO2") {
-    if (zeroNO2()) {
-      no2LastZeroing = timeClient.getFormattedDate();
-      preferences.begin("klimerko", false);
-      preferences.putString(preferences_no2LastZeroing, no2LastZeroing);
-      preferences.end();
-    } else {
-      no2LastFailedZeroing = timeClient.getFormattedDate();
-      preferences.begin("klimerko", false);
-      preferences.putString(preferences_no2LastFailedZeroing, no2LastFailedZeroing);
-      preferences.end();
-    }
-  } else if (sensor == "ALL") {
-    if (zeroSO2()) {
-      so2LastZeroing = timeClient.getFormattedDate();
-      preferences.begin("klimerko", false);
-      preferences.putString(preferences_so2LastZeroing, so2LastZeroing);
-      preferences.end();
-    } else {
-      so2LastFailedZeroing = timeClient.getFormattedDate();
-      preferences.begin("klimerko", false);
-      preferences.putString(preferences_so2LastFailedZeroing, so2LastFailedZeroing);
-      preferences.end();
-    }
-    if (zeroNO2()) {
-      no2LastZeroing = timeClient.getFormattedDate();
-      preferences.begin("klimerko", false);
-      preferences.putString(preferences_no2LastZeroing, no2LastZeroing);
-      preferences.end();
-    } else {
-      no2LastFailedZeroing = timeClient.getFormattedDate();
-      preferences.begin("klimerko", false);
-      preferences.putString(preferences_no2LastFailedZeroing, no2LastFailedZeroing);
-      preferences.end();
-    }
-  } else {
-    spln("Wrong parameter used for 'zeroSensor(String)'");
-    return;
+void sensorTask(void *parameter) { // Reads sensors on the core that isn't running loop(), so WiFi, MQTT and OTA can't delay it
+  esp_task_wdt_add(NULL);
+  so2.init();
+  no2.init();
+  pms.init();
+  sensorDataLastRead = millis();
+  while (true) {
+    esp_task_wdt_reset(); // Reset the watchdog timer so the device doesn't reboot
+    so2.loop();
+    no2.loop();
+    sensorReadLoop();
+    readCycleLoop();
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(sensorTaskPollInterval)); // Sleep until a UART receives data or the poll interval passes
   }
+}
 
-  spln("Zeroing Data Written to Persistant Storage.");
-  publishMetadata();
+void handlePMSSample(uint16_t pm01, uint16_t pm25, uint16_t pm10, uint32_t time) { // Called from loop() for each reading the sensor task made
+  pm1Current   = pm01;
+  pm2_5Current = pm25;
+  pm10Current  = pm10;
+
+  int32_t values[3] = { pm1Current, pm2_5Current, pm10Current };
+  sensorFilterApply(STATS_PM1, values, 3);
+  sensorStats.add(STATS_PM1, values, 3);
+  sensorWindow.averages.add(STATS_PM1, time, values, 3, sensorReadMaxHold());
+  rollupWindow.averages.add(STATS_PM1, time, values, 3, sensorReadMaxHold());
+  pm1Average   = sensorStats.roundedMean(STATS_PM1);
+  pm2_5Average = sensorStats.roundedMean(STATS_PM2_5);
+  pm10Average  = sensorStats.roundedMean(STATS_PM10);
+
+  sp("[PMS] PM 1: ");
+  sp(pm1Current);
+  sp(", PM 1 Avg: ");
+  sp(pm1Average);
+  sp(", PM 2.5: ");
+  sp(pm2_5Current);
+  sp(", PM 2.5 Avg: ");
+  sp(pm2_5Average);
+  sp(", PM 10: ");
+  sp(pm10Current);
+  sp(", PM 10 Avg: ");
+  spln(pm10Average);
 }
 
-void publishSensorData() {
-  char JSONmessageBuffer[2048];
-  DynamicJsonDocument doc(2048);
-  doc["sent_at"] = timeClient.getFormattedDate();
-  doc["client_id"] = MQTT_CLIENT_ID;
-  JsonObject data = doc.createNestedObject("data");
+void handlePMSEvent(const SensorEvent &event) {
+  switch (event.type) {
+    case SENSOR_EVENT_SAMPLE:
+      handlePMSSample(event.pm01, event.pm25, event.pm10, event.time);
+      break;
 
-  if (so2SensorOnline) {
-    data["SO2"]             = so2AverageConcentration;
-    data["so2_adc"]         = so2CurrentConcentrationADC;
-    data["so2_ready"]       = so2SensorReady;
-  } else {
-    spln("[DATA] Won't publish SO2 data since the sensor is offline.");
-  }
+    case SENSOR_EVENT_ONLINE:
+      publishMetadata();
+      break;
 
-  if (no2SensorOnline) {
-    data["NO2"]             = no2AverageConcentration;
-    data["no2_adc"]         = no2CurrentConcentrationADC;
-    data["no2_ready"]       = no2SensorReady;
-  } else {
-    spln("[DATA] Won't publish NO2 data since the sensor is offline.");
-  }
+    case SENSOR_EVENT_OFFLINE:
+      // Reset the averaging since we don't know how long the sensor was offline
+      spln("[PMS] Averaging Data Reset Because Sensor is Offline.");
+      sensorFilter.reset(STATS_PM1, 3);
+      sensorStats.reset(STATS_PM1, 3);
+      sensorWindow.averages.reset(STATS_PM1, 3);
+      rollupWindow.averages.reset(STATS_PM1, 3);
+      publishMetadata();
+      break;
 
-  if (pmsSensorOnline) {
-    data["PM1"]             = pm1Average;
-    data["PM2_5"]           = pm2_5Average;
-    data["PM10"]            = pm10Average;
-  } else {
-    spln("[DATA] Won't publish PMS data since the sensor is offline.");
+    default:
+      break;
   }
+}
 
-  if (no2SensorOnline) {
-    data["temperature"]     = no2AverageTemperature;
-    data["humidity"]        = no2AverageHumidity;
-  } else if (so2SensorOnline) {
-    spln("[DATA] Using SO2 Temperature & Humidity data because NO2 is offline.");
-    data["temperature"]     = so2AverageTemperature;
-    data["humidity"]        = so2AverageHumidity;
-  } else {
-    spln("[DATA] Won't publish Temperature & Humidity data - both SO2 and NO2 are offline.");
+void wallClockWindowBegin(WallClockWindow &window, unsigned long length, uint32_t now) { // Starts the window that's current at 'now' (loop())
+  // Boundaries are placed to the millisecond on the NTP time, millis() and esp_timer_get_time() run on the same clock
+  uint64_t      epochMillis = timeClient.getEpochMillis();
+  unsigned long epoch       = epochMillis / 1000;
+  unsigned long startEpoch  = epoch - epoch % length;
+  uint32_t      start       = now - (uint32_t)(epochMillis - (uint64_t)startEpoch * 1000);
+  bool          continues   = window.active && window.length == length;
+  if (continues && startEpoch == window.startEpoch) { // Clock is slightly behind millis(), the window that was just closed hasn't ended by it yet
+    startEpoch += length;
   }
+  if (continues && startEpoch == window.startEpoch + length) {
+    start = window.averages.end(); // Follows the previous window without a gap or an overlap
+  }
+  window.startEpoch = startEpoch;
+  window.length     = length;
+  window.averages.begin(start, now + (uint32_t)((uint64_t)(startEpoch + length) * 1000 - epochMillis));
+  window.active     = true;
+}
 
-  sp("[DATA] Sending Sensor Data: ");
-  serializeJson(doc, JSONmessageBuffer);
-  serializeJson(doc, Serial);
-  spln("");
+bool wallClockWindowDue(const WallClockWindow &window, uint32_t time) {
+  return window.active && (int32_t)(time - window.averages.end()) >= 0;
+}
 
-  // v1.devices.{deviceId}.actions.ingest
-  char topic[128];
-  snprintf(topic, sizeof topic, "%s%s%s", "v1/devices/", MQTT_CLIENT_ID, "/actions/ingest");
+void sensorRollupMinute() { // Closes the one minute window and adds it to the rollups (loop())
+  int64_t  sums[STATS_CHANNEL_COUNT];
+  uint32_t covered[STATS_CHANNEL_COUNT];
+  rollupWindow.averages.close();
+  for (uint8_t channel = 0; channel < STATS_CHANNEL_COUNT; channel++) {
+    sums[channel]    = rollupWindow.averages.sum(channel);
+    covered[channel] = rollupWindow.averages.covered(channel);
+  }
+  sensorRollup.addMinute(rollupWindow.startEpoch / 60, sums, covered);
+  wallClockWindowBegin(rollupWindow, 60, millis());
+}
 
-  if (mqtt.publish(topic, JSONmessageBuffer, true)) {
-    spln("[MQTT] Sensor data sent!");
-  } else {
-    spln("[MQTT] Sensor data failed to send.");
+void sensorRollupLoop() {
+  if (!rollupWindow.active && timeClient.getEpochTime() >= wallClockValidEpoch) {
+    wallClockWindowBegin(rollupWindow, 60, millis());
+  }
+  if (wallClockWindowDue(rollupWindow, millis())) {
+    sensorRollupMinute();
   }
 }
 
-void publishSensorDataLoop() {
-  publishSensorDataLoopCurrentTime = millis();
-  if (millis() - sensorDataLastRead >= sensorDataReadInterval*1000) {
-    spln("[DATA] Reading Sensor Data...");
-    if (so2SensorOnline) { // Read the sensor if it's online. If it's considered offline, fallback to less frequent reading (just to check if it has been connected)
-      readSO2();
-    } else if (publishSensorDataLoopCurrentTime - so2SensorLastRecoveryAttemptTime >= sensorDataReadIntervalWhenConsideredOffline * 1000) {
-      spln("[SO2] Now checking for availability");
-      readSO2();
-      if (!so2SensorOnline) {
-        sp("[SO2] Will check for availability again in ");
-        sp(sensorDataReadIntervalWhenConsideredOffline);
-        spln(" seconds.");
-      }
-      so2SensorLastRecoveryAttemptTime = publishSensorDataLoopCurrentTime;
-    }
-
-    if (no2SensorOnline) { // Read the sensor if it's online. If it's considered offline, fallback to less frequent reading (just to check if it has been connected)
-      readNO2();
-    } else if (publishSensorDataLoopCurrentTime - no2SensorLastRecoveryAttemptTime >= sensorDataReadIntervalWhenConsideredOffline * 1000) {
-      spln("[NO2] Now checking for availability");
-      readNO2();
-      if (!no2SensorOnline) {
-        sp("[NO2] Will check for availability again in ");
-        sp(sensorDataReadIntervalWhenConsideredOffline);
-        spln(" seconds.");
+void publishSensorWindow() { // Closes the wall-clock window, publishes its averages and starts the next one (loop())
+  sensorWindow.averages.close();
+  so2.windowClosed();
+  no2.windowClosed();
+  if (sensorWindow.averages.covered(STATS_PM1)) {
+    pm1Average   = lroundf(sensorWindow.averages.mean(STATS_PM1));
+    pm2_5Average = lroundf(sensorWindow.averages.mean(STATS_PM2_5));
+    pm10Average  = lroundf(sensorWindow.averages.mean(STATS_PM10));
+  }
+  spln("[DATA] Publishing Sensor Data...");
+  publishSensorData();
+  sensorDataLastPublish = millis();
+  wallClockWindowBegin(sensorWindow, sensorDataPublishInterval, sensorDataLastPublish);
+}
+
+void processSensorEvents() { // Applies what the sensor task has read (averaging, metadata, persistant storage)
+  SensorLogLine line;
+  while (sensorTaskLog.pop(line)) { // Printed first, they're about the events below
+    spln(line.text);
+  }
+  SensorEvent event;
+  while (sensorEvents.pop(event)) {
+    if (event.type == SENSOR_EVENT_SAMPLE) {
+      sensorLastSampleTimestamp = event.timestamp;
+    }
+    if (event.type == SENSOR_EVENT_SAMPLE && wallClockWindowDue(rollupWindow, event.time)) {
+      sensorRollupMinute(); // Sample belongs to the next minute
+    }
+    if (event.type == SENSOR_EVENT_SAMPLE && wallClockWindowDue(sensorWindow, event.time) && !wm.getConfigPortalActive()) {
+      publishSensorWindow(); // Sample belongs to the next window
+    }
+    if (event.type == SENSOR_EVENT_READ_CYCLE) {
+      readCycleCount++;
+      readCycleLatencyLast = event.cycleLatency;
+      readCycleLatencySum += event.cycleLatency;
+      if (event.cycleLatency > readCycleLatencyMax) {
+        readCycleLatencyMax = event.cycleLatency;
       }
-      no2SensorLastRecoveryAttemptTime = publishSensorDataLoopCurrentTime;
-    }
-
-    if (pmsSensorOnline) { // Read the sensor if it's online. If it's considered offline, fallback to less frequent reading (just to check if it has been connected)
-      readPMS();
-    } else if (publishSensorDataLoopCurrentTime - pmsSensorLastRecoveryAttemptTime >= sensorDataReadIntervalWhenConsideredOffline * 1000) {
-      spln("[PMS] Now checking for availability");
-      readPMS();
-      if (!pmsSensorOnline) {
-        sp("[PMS] Will check for availability again in ");
-        sp(sensorDataReadIntervalWhenConsideredOffline);
-        spln(" seconds.");
+      if (event.deadlineMissed) {
+        readCycleDeadlineMisses++;
       }
-      pmsSensorLastRecoveryAttemptTime = publishSensorDataLoopCurrentTime;
+    } else if (event.sensor == SENSOR_SO2) {
+      so2.handleEvent(event);
+    } else if (event.sensor == SENSOR_NO2) {
+      no2.handleEvent(event);
+    } else {
+      handlePMSEvent(event);
     }
-    sensorDataLastRead = publishSensorDataLoopCurrentTime;
   }
+}
+
+void publishSensorDataLoop() {
   publishSensorDataLoopCurrentTime = millis();
+  if (sensorDataWallClockWindows) {
+    if (!sensorWindow.active && timeClient.getEpochTime() >= wallClockValidEpoch) {
+      spln("[DATA] Clock is set, sensor data is now averaged over wall-clock windows.");
+      wallClockWindowBegin(sensorWindow, sensorDataPublishInterval, publishSensorDataLoopCurrentTime);
+    }
+    if (wallClockWindowDue(sensorWindow, publishSensorDataLoopCurrentTime)) {
+      publishSensorWindow();
+    }
+    if (sensorWindow.active) {
+      return;
+    }
+  }
   if (millis() - sensorDataLastPublish >= sensorDataPublishInterval*1000) {
     spln("[DATA] Publishing Sensor Data...");
     publishSensorData();
@@ -1068,9 +2268,37 @@ void publishSensorDataLoop() {
   }
 }
 
-void setSensorDataPublishInterval(int interval) {
+void applySensorDataPublishInterval() { // Nothing is reallocated or reset, averages in progress are kept
+  // Sensor task reads at the new cadence from its next read. A wall-clock window that's in progress keeps its length
+  // and the windows after it get the new one, see wallClockWindowBegin()
+  sensorDataReadInterval = sensorDataPublishInterval / sensorAveragingSamples;
+}
+
+bool setSensorBatchSize(int size) {
+  if (size >= 1 && size <= sensorBatchMax) {
+    sensorBatchSize = size;
+    preferences.begin("klimerko", false);
+    preferences.putInt(preferences_sensorBatchSize, sensorBatchSize);
+    preferences.end();
+    sp("Sensor Data Batch Size Changed to: ");
+    sp(sensorBatchSize);
+    spln(" readings. Saved in persistant memory.");
+    publishMetadata();
+    return true;
+  } else {
+    sp("Failed to set new Sensor Data Batch Size. The argument '");
+    sp(size);
+    sp("' is not within range (1 - ");
+    sp(sensorBatchMax);
+    spln(" readings)");
+    return false;
+  }
+}
+
+bool setSensorDataPublishInterval(int interval) {
   if (interval >= sensorDataPublishIntervalMin && interval <= sensorDataPublishIntervalMax) {
     sensorDataPublishInterval = interval;
+    applySensorDataPublishInterval();
     preferences.begin("klimerko", false);
     preferences.putInt(preferences_sensorDataPublishInterval, sensorDataPublishInterval);
     preferences.end();
@@ -1078,6 +2306,7 @@ void setSensorDataPublishInterval(int interval) {
     sp(sensorDataPublishInterval);
     spln(" seconds. Saved in persistant memory.");
     publishMetadata();
+    return true;
   } else {
     sp("Failed to set new Sensor Data Publishing Interval. The argument '");
     sp(interval);
@@ -1086,6 +2315,7 @@ void setSensorDataPublishInterval(int interval) {
     sp(" - ");
     sp(sensorDataPublishIntervalMax);
     spln(" seconds)");
+    return false;
   }
 }
 
@@ -1130,7 +2360,7 @@ void firmwareUpdateError(int error) {
   preferences.end();
 }
 
-void firmwareUpdate(bool forced) { // Using argument "true" will force a firmware update - will not check firmware version and TLS
+bool firmwareUpdate(bool forced) { // Using argument "true" will force a firmware update - will not check firmware version and TLS. Only returns if it wasn't installed.
   WiFiClientSecure firmwareNetworkClient;
   if (forced) {
     spln("[OTA] Running Forced Firmware Update... >>>> DO NOT POWER OFF THE DEVICE <<<<");
@@ -1144,6 +2374,9 @@ void firmwareUpdate(bool forced) { // Using argument "true" will force a firmwar
   httpUpdate.onProgress(firmwareUpdateProgress);
   httpUpdate.onError(firmwareUpdateError);
   httpUpdate.rebootOnUpdate(true);
+  // loop() doesn't take sensor events until this returns, readings and zeroing results that don't fit the queue meanwhile
+  // are dropped (counted in sensorEventsDropped), a zeroing command left waiting for its result times out
+  spln("[OTA] Sensor events that don't fit the queue during the update will be dropped.");
   esp_task_wdt_reset(); // Reset the watchdog timer so the device doesn't reboot
   t_httpUpdate_return ret = httpUpdate.update(firmwareNetworkClient, firmwareUpdateFirmwareURL);
 
@@ -1163,6 +2396,7 @@ void firmwareUpdate(bool forced) { // Using argument "true" will force a firmwar
     spln("[OTA] HTTP_UPDATE_OK");
     break;
   }
+  return ret == HTTP_UPDATE_OK;
 }
 
 bool firmwareUpdateCheck() {
@@ -1416,21 +2650,310 @@ void wifiConfigButton() {
   wifiConfigButtonLastState = wifiConfigButtonCurrentState;
 }
 
-void mqttCallback(char* p_topic, byte* p_payload, unsigned int p_length) {
-  //concat the payload into a string
-  String payload;
-  for (uint8_t i = 0; i < p_length; i++) {
-    payload.concat((char)p_payload[i]);
+class MqttPublishStream : public Print { // Collects serializer output into chunks for mqtt.write(), which sends each write on its own
+  public:
+    MqttPublishStream() : _length(0), _written(0) {}
+
+    size_t write(uint8_t c) override {
+      _buffer[_length++] = c;
+      if (_length == sizeof _buffer) {
+        flushChunk();
+      }
+      return 1;
+    }
+
+    // Sends what's left, true if all 'length' bytes announced by beginPublish() went out
+    bool end(size_t length) {
+      flushChunk();
+      return mqtt.endPublish() && _written == length;
+    }
+
+  private:
+    void flushChunk() {
+      _written += mqtt.write(_buffer, _length);
+      _length   = 0;
+    }
+
+    uint8_t _buffer[mqttPublishChunkSize];
+    size_t  _length;
+    size_t  _written;
+};
+
+bool mqttPublishEncoded(const char* topic, JsonDocument &doc, bool msgpack, bool retained, uint8_t qos) { // Without copying the payload into a buffer
+  if (!mqttReady()) {
+    return false;
+  }
+  size_t length = msgpack ? measureMsgPack(doc) : measureJson(doc);
+  if (qos) { // Serialized straight into its mqttOutbox slot, sent from there and again from there after a reconnect
+    char* payload = (char*)mqttOutbox.begin(topic, retained, length);
+    if (!payload) {
+      spln("[MQTT] Too many messages waiting for an acknowledgement or message too large.");
+      return false;
+    }
+    msgpack ? serializeMsgPack(doc, payload, length + 1) : serializeJson(doc, payload, length + 1);
+    size_t         packetLength;
+    const uint8_t* packet = mqttOutbox.commit(packetLength);
+    if (mqttClient.write(packet, packetLength) != packetLength) {
+      spln("[MQTT] Message was cut short, reconnecting. It's sent again after that.");
+      mqtt.disconnect();
+    }
+    return true;
+  }
+  if (!mqtt.beginPublish(topic, length, retained)) {
+    return false;
+  }
+  MqttPublishStream stream;
+  msgpack ? serializeMsgPack(doc, stream) : serializeJson(doc, stream);
+  if (!stream.end(length)) {
+    spln("[MQTT] Payload was cut short, reconnecting.");
+    mqtt.disconnect(); // The broker is still waiting for the rest of the packet
+    return false;
+  }
+  return true;
+}
+
+bool mqttPublishPayload(const char* topic, JsonDocument &doc, bool retained, uint8_t qos) { // In every mqttPayloadEncoding, true if all were sent (or are in flight at QoS 1)
+  bool sent = true;
+  if (mqttPayloadEncoding & PAYLOAD_JSON) {
+    sent = mqttPublishEncoded(topic, doc, false, retained, qos);
+  }
+  if (mqttPayloadEncoding & PAYLOAD_MSGPACK) {
+    JsonDocument &compact = publishCompactDocument;
+    compact.clear(); // Converted to a JsonVariant below, which wouldn't free the previous payload
+    payloadCompact(doc, compact);
+    compact["v"] = PAYLOAD_SCHEMA_VERSION;
+    char msgpackTopic[128];
+    snprintf(msgpackTopic, sizeof msgpackTopic, "%s/msgpack", topic);
+    if (compact.overflowed() || !mqttPublishEncoded(msgpackTopic, compact, true, retained, qos)) {
+      spln("[MQTT] MessagePack payload failed to send.");
+      sent = false;
+    }
+  }
+  return sent;
+}
+
+void mqttResendUnacknowledged() { // QoS 1 messages that were in flight when the connection was lost, oldest first (after connecting)
+  if (!mqttOutbox.inFlight()) {
+    return;
+  }
+  sp("[MQTT] Sending ");
+  sp(mqttOutbox.inFlight());
+  spln(" unacknowledged message(s) again.");
+  mqttOutbox.resend([](const uint8_t* packet, size_t length) {
+    mqttClient.write(packet, length);
+  });
+}
+
+bool commandZeroSensors(int32_t) { // Zeroing itself is done by the sensor task, see mqttCommandZeroFinished()
+  zeroSensors("ALL");
+  return true;
+}
+
+bool commandZeroSO2(int32_t) {
+  zeroSensors("SO2");
+  return true;
+}
+
+bool commandZeroNO2(int32_t) {
+  zeroSensors("NO2");
+  return true;
+}
+
+bool commandEraseWifiCredentials(int32_t) {
+  wifiConfigEraseCredentials();
+  return true;
+}
+
+bool commandReboot(int32_t) {
+  spln("Rebooting the device now...");
+  wm.reboot();
+  return true;
+}
+
+bool commandEraseZeroing(int32_t) {
+  preferences.begin("klimerko", false);
+  so2.eraseZeroing();
+  no2.eraseZeroing();
+  preferences.end();
+  spln("[Persistant Storage] Zeroing Data Erased from Persistant Storage!");
+  publishMetadata();
+  return true;
+}
+
+bool commandPublishInterval(int32_t value) {
+  return setSensorDataPublishInterval(value);
+}
+
+bool commandBatchSize(int32_t value) {
+  return setSensorBatchSize(value);
+}
+
+bool commandIdentify(int32_t) {
+  spln("Blinking the LED Green to Identify Device (Same green flash as when device is connected)...");
+  rgbEffect_GreenBlink = true;
+  return true;
+}
+
+bool commandForceOta(int32_t) {
+  spln("Forcing the download & installation of the newest firmware available for Klimerko Pro...");
+  return firmwareUpdate(true); // Force the firmware update
+}
+
+struct MqttCommand {
+  const char* field;                // Key in the "data" of a "device_config" message
+  bool        trigger;              // Runs if the value is true, otherwise if it's set to anything but 0/false
+  uint8_t     priority;             // Higher runs first, so quick commands don't wait behind long or final ones
+  bool      (*run)(int32_t value);  // False if it failed
+  uint8_t     zeroes;               // Bit per SensorId the command zeroes, it's done once they all report back
+};
+
+// Commands of the same priority run in this order when a message has several of them
+const MqttCommand mqttCommands[] = {
+  { "zero_sensors",               true,  2, commandZeroSensors,          1 << SENSOR_SO2 | 1 << SENSOR_NO2 },
+  { "zero_so2",                   true,  2, commandZeroSO2,              1 << SENSOR_SO2 },
+  { "zero_no2",                   true,  2, commandZeroNO2,              1 << SENSOR_NO2 },
+  { "erase_wifi_credentials",     true,  0, commandEraseWifiCredentials, 0 },
+  { "reboot_device",              true,  0, commandReboot,               0 },
+  { "erase_zeroing_data",         true,  2, commandEraseZeroing,         0 },
+  { "sensor_publishing_interval", false, 3, commandPublishInterval,      0 },
+  { "sensor_batch_size",          false, 3, commandBatchSize,            0 },
+  { "identify_device",            true,  3, commandIdentify,             0 },
+  { "force_ota_update",           true,  1, commandForceOta,             0 },
+};
+const uint8_t mqttCommandCount = sizeof mqttCommands / sizeof mqttCommands[0];
+
+struct MqttCommandRequest {
+  uint8_t       command;            // Index in mqttCommands
+  int32_t       value;
+  unsigned long queuedAt;           // millis()
+  char          correlationId[40];  // From the message, sent back with the response
+};
+
+struct MqttCommandAwaiting {         // Zeroing command whose result comes later from the sensor task
+  MqttCommandRequest request;
+  uint8_t            waiting;           // Bit per SensorId that hasn't reported back yet, 0 if the entry is free
+  bool               failed;
+  unsigned long      startedAt;         // micros()
+};
+
+const int      mqttCommandResultTimeout = 60; // [seconds] A zeroing that hasn't reported back by then is reported as failed
+StaticJsonDocument<384> mqttCommandFilter;  // Only "type", "correlation_id" and the command fields are kept from received messages
+CommandQueue<MqttCommandRequest, 8> mqttCommandQueue; // Run by mqttCommandLoop(), outside of mqtt.loop()
+MqttCommandAwaiting mqttCommandsAwaiting[2];
+
+void initMqttCommands() {
+  mqttCommandFilter["type"]           = true;
+  mqttCommandFilter["correlation_id"] = true;
+  JsonObject data = mqttCommandFilter.createNestedObject("data");
+  for (uint8_t i = 0; i < mqttCommandCount; i++) {
+    data[mqttCommands[i].field] = true;
+  }
+}
+
+void mqttCommandRespond(const MqttCommandRequest &request, const char* status, long duration = -1) { // On v1/devices/{deviceId}/actions/response
+  char sentAt[24];
+  JsonDocument &doc = publishDocument;
+  doc.clear();
+  doc["type"]      = "device_config_response";
+  doc["client_id"] = MQTT_CLIENT_ID;
+  if (request.correlationId[0]) {
+    doc["correlation_id"] = (char*)request.correlationId;
+  }
+  doc["sent_at"]   = formatUtcTime(timeClient.getEpochTime(), sentAt, sizeof sentAt);
+  doc["command"]   = mqttCommands[request.command].field;
+  doc["status"]    = status;
+  if (duration >= 0) {
+    doc["duration"] = duration; // [microseconds]
+  }
+  char topic[128];
+  snprintf(topic, sizeof topic, "%s%s%s", "v1/devices/", MQTT_CLIENT_ID, "/actions/response");
+  mqttPublishPayload(topic, doc, false);
+}
+
+void mqttCommandAwait(const MqttCommandRequest &request, uint8_t sensors, unsigned long startedAt) {
+  for (MqttCommandAwaiting &awaiting : mqttCommandsAwaiting) {
+    if (!awaiting.waiting) {
+      awaiting = { request, sensors, false, startedAt };
+      return;
+    }
+  }
+  spln("[MQTT] Too many zeroing commands in progress, this one's result only goes to metadata.");
+}
+
+void mqttCommandFinish(MqttCommandAwaiting &awaiting) {
+  unsigned long duration = micros() - awaiting.startedAt;
+  sp("[MQTT] Command '");
+  sp(mqttCommands[awaiting.request.command].field);
+  sp(awaiting.failed ? "' failed after " : "' done in ");
+  sp(duration);
+  spln(" us.");
+  mqttCommandRespond(awaiting.request, awaiting.failed ? "failed" : "done", duration);
+  awaiting.waiting = 0;
+}
+
+void mqttCommandZeroFinished(SensorId sensor, bool success) { // Called with every zeroing result (loop())
+  for (MqttCommandAwaiting &awaiting : mqttCommandsAwaiting) {
+    if (awaiting.waiting & (1 << sensor)) {
+      awaiting.waiting &= ~(1 << sensor);
+      awaiting.failed  |= !success;
+      if (!awaiting.waiting) {
+        mqttCommandFinish(awaiting);
+      }
+    }
+  }
+}
+
+void mqttCommandAwaitLoop() { // Gives up on zeroing results that never came
+  for (MqttCommandAwaiting &awaiting : mqttCommandsAwaiting) {
+    if (awaiting.waiting && micros() - awaiting.startedAt >= mqttCommandResultTimeout * 1000000UL) {
+      awaiting.failed = true;
+      mqttCommandFinish(awaiting);
+    }
+  }
+}
+
+void mqttCommandLoop() { // Runs the most urgent queued command, one per loop() so the MQTT connection is serviced in between
+  mqttCommandAwaitLoop();
+  MqttCommandRequest request;
+  if (!mqttCommandQueue.pop(request)) {
+    return;
   }
+  const MqttCommand &command = mqttCommands[request.command];
+  sp("[MQTT] Running command '");
+  sp(command.field);
+  sp("' after ");
+  sp(millis() - request.queuedAt);
+  spln(" ms in the queue.");
+  mqttCommandRespond(request, "started"); // Reboots and firmware updates don't come back
+  unsigned long start   = micros();
+  bool          success = command.run(request.value);
+  mqttLastCommand        = command.field;
+  mqttLastCommandLatency = micros() - start;
+  if (success && command.zeroes) {
+    spln("[MQTT] Zeroing requested, the result is sent once the sensors report back.");
+    mqttCommandRespond(request, "accepted");
+    mqttCommandAwait(request, command.zeroes, start);
+    return;
+  }
+  sp("[MQTT] Command '");
+  sp(command.field);
+  sp(success ? "' done in " : "' failed after ");
+  sp(mqttLastCommandLatency);
+  spln(" us.");
+  mqttCommandRespond(request, success ? "done" : "failed", mqttLastCommandLatency);
+}
 
+void mqttCallback(char* p_topic, byte* p_payload, unsigned int p_length) { // Only queues the commands, they're run by mqttCommandLoop()
   sp("[MQTT] Received Message '");
-  sp(payload);
+  Serial.write(p_payload, p_length);
   sp("' on topic '");
   sp(p_topic);
   spln("' ");
 
+  // Parsed straight from PubSubClient's buffer. The input is passed as const so strings are copied into the document:
+  // a response to a rejected command reuses that buffer, which would break zero-copy strings that point into it.
   StaticJsonDocument<512> doc;
-  DeserializationError error = deserializeJson(doc, payload);
+  DeserializationError error = deserializeJson(doc, (const char*)p_payload, p_length, DeserializationOption::Filter(mqttCommandFilter));
 
   if (error) {
     sp("[MQTT] deserializeJson() failed: ");
@@ -1438,48 +2961,26 @@ void mqttCallback(char* p_topic, byte* p_payload, unsigned int p_length) {
     return;
   }
 
-  if (doc["type"] == "device_config") {
-    if (doc["data"]["zero_sensors"] == true) {
-      zeroSensors("ALL");
-    }
-    if (doc["data"]["zero_so2"] == true) {
-      zeroSensors("SO2");
-    }
-    if (doc["data"]["zero_no2"] == true) {
-      zeroSensors("NO2");
-    }
-    if (doc["data"]["erase_wifi_credentials"] == true) {
-      wifiConfigEraseCredentials();
-    }
-    if (doc["data"]["reboot_device"] == true) {
-      spln("Rebooting the device now...");
-      wm.reboot();
-    }
-    if (doc["data"]["erase_zeroing_data"] == true) {
-      preferences.begin("klimerko", false);
-      preferences.putString(preferences_no2LastZeroing, preferences_LastZeroingDefault);
-      preferences.putString(preferences_no2LastFailedZeroing, preferences_LastFailedZeroingDefault);
-      preferences.putString(preferences_so2LastZeroing, preferences_LastZeroingDefault);
-      preferences.putString(preferences_so2LastFailedZeroing, preferences_LastFailedZeroingDefault);
-      preferences.end();
-      so2LastZeroing = preferences_LastZeroingDefault;
-      so2LastFailedZeroing = preferences_LastFailedZeroingDefault;
-      no2LastZeroing = preferences_LastZeroingDefault;
-      no2LastFailedZeroing = preferences_LastFailedZeroingDefault;
-      spln("[Persistant Storage] Zeroing Data Erased from Persistant Storage!");
-      publishMetadata();
-    }
-    if (doc["data"]["sensor_publishing_interval"]) {
-      spln("Received message to set sensor data publishing interval, but this feature is disabled because of sensor averaging.");
-      //setSensorDataPublishInterval(doc["data"]["sensor_publishing_interval"]);
-    }
-    if (doc["data"]["identify_device"] == true) {
-      spln("Blinking the LED Green to Identify Device (Same green flash as when device is connected)...");
-      rgbEffect_GreenBlink = true;
+  if (doc["type"] != "device_config") {
+    return;
+  }
+  JsonObjectConst data = doc["data"];
+  for (uint8_t i = 0; i < mqttCommandCount; i++) {
+    const MqttCommand &command = mqttCommands[i];
+    JsonVariantConst   value   = data[command.field];
+    if (command.trigger ? value != true : !value.as<bool>()) {
+      continue;
     }
-    if (doc["data"]["force_ota_update"] == true) {
-      spln("Forcing the download & installation of the newest firmware available for Klimerko Pro...");
-      firmwareUpdate(true); // Force the firmware update
+    MqttCommandRequest request;
+    request.command  = i;
+    request.value    = value.as<int32_t>();
+    request.queuedAt = millis();
+    strlcpy(request.correlationId, doc["correlation_id"] | "", sizeof request.correlationId);
+    if (!mqttCommandQueue.push(request, command.priority)) {
+      sp("[MQTT] Command queue is full, command '");
+      sp(command.field);
+      spln("' rejected.");
+      mqttCommandRespond(request, "rejected");
     }
   }
 }
@@ -1493,54 +2994,189 @@ void mqttSubscribeTopics() {
   spln(eventTopic);
 }
 
-bool connectMQTT() { // Connects to MQTT
-  if (!wifiConnectionLost) {
-    sp("[MQTT] Connecting to ");
-    sp(MQTT_SERVER);
-    sp(" as '");
-    sp(MQTT_USERNAME);
-    // sp("' using password '");
-    // sp(MQTT_PASSWORD);
-    spln("'");
-    if (mqtt.connect(MQTT_CLIENT_ID, MQTT_USERNAME, MQTT_PASSWORD)) {
-      spln("[MQTT] Connected!");
-      mqttSubscribeTopics();
-      if (mqttConnectionLost) {
-        // TODO?: Turn off LED
-        mqttConnectionLost = false;
-        publishMetadata();
-      }
-      rgbEffect_GreenBlink = true;
-      return true;
-    } else {
-      sp("[MQTT] Connection Failed, Reason: ");
-      spln(mqtt.state());
-      return false;
-    }
+bool mqttReady() { // Connected and subscribed
+  return mqttPhase == MQTT_PHASE_CONNECTED && mqtt.connected();
+}
+
+void mqttEnterPhase(MqttPhase phase) { // Records how long the current phase took
+  mqttPhaseTime[mqttPhase] = millis() - mqttPhaseStart;
+  mqttPhase                = phase;
+  mqttPhaseStart           = millis();
+}
+
+bool mqttPhaseTimedOut() {
+  return millis() - mqttPhaseStart >= mqttPhaseTimeout * 1000UL;
+}
+
+void mqttConnectFailed(const char* reason) { // Gives up the attempt, the next one starts after mqttReconnectInterval
+  sp("[MQTT] Connection Failed (");
+  sp(mqttPhaseNames[mqttPhase]);
+  sp("), Reason: ");
+  spln(reason);
+  if (mqttSocket >= 0) {
+    lwip_close(mqttSocket);
+    mqttSocket = -1;
   }
-  return false;
+  mqtt.disconnect(); // Also resets PubSubClient's state, otherwise its next connect() could skip CONNECT
+  mqttConnectionLost       = true;
+  mqttReconnectLastAttempt = millis();
+  mqttEnterPhase(MQTT_PHASE_IDLE);
 }
 
-void maintainMQTT() { // Reconnects to MQTT if connection lost, otherwise loops MQTT client
-  if (mqtt.connected()) {
-    if (mqttConnectionLost) {
-      mqttConnectionLost = false; // Redundant because it's set in connectMQTT function if it succeeds
-      rgbEffect_GreenBlink = true;
-    }
-    mqtt.loop();
-  } else {
-    if (!mqttConnectionLost) {
-      spln("[MQTT] Lost Connection...");
-      mqttConnectionLost = true;
-    }
-    if (millis() - mqttReconnectLastAttempt >= mqttReconnectInterval * 1000) {
-      connectMQTT();
-      mqttReconnectLastAttempt = millis();
-    }
+void mqttResolved(const char* name, const ip_addr_t* address, void* generation) { // DNS callback, runs in the TCP/IP task
+  if ((uint32_t)(uintptr_t)generation != mqttResolveGeneration) {
+    return;
+  }
+  mqttResolvedAddress = address ? address->u_addr.ip4.addr : 0;
+  mqttResolveDone     = true;
+}
+
+void mqttStartResolve() {
+  sp("[MQTT] Connecting to ");
+  sp(MQTT_SERVER);
+  sp(" as '");
+  sp(MQTT_USERNAME);
+  // sp("' using password '");
+  // sp(MQTT_PASSWORD);
+  spln("'");
+  mqttEnterPhase(MQTT_PHASE_RESOLVE);
+  mqttResolveDone       = false;
+  mqttResolveGeneration = mqttResolveGeneration + 1;
+  ip_addr_t address;
+  err_t result = dns_gethostbyname(MQTT_SERVER, &address, mqttResolved, (void*)(uintptr_t)mqttResolveGeneration);
+  if (result == ERR_OK) { // Cached (or MQTT_SERVER is an address)
+    mqttResolvedAddress = address.u_addr.ip4.addr;
+    mqttResolveDone     = true;
+  } else if (result != ERR_INPROGRESS) {
+    mqttConnectFailed("DNS lookup couldn't be started");
+  }
+}
+
+void mqttStartConnect() { // Non-blocking TCP connect to the resolved address
+  mqttEnterPhase(MQTT_PHASE_CONNECT);
+  mqttSocket = lwip_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+  if (mqttSocket < 0) {
+    mqttConnectFailed("No free socket");
+    return;
+  }
+  lwip_fcntl(mqttSocket, F_SETFL, lwip_fcntl(mqttSocket, F_GETFL, 0) | O_NONBLOCK);
+  struct sockaddr_in server;
+  memset(&server, 0, sizeof server);
+  server.sin_family      = AF_INET;
+  server.sin_port        = htons(MQTT_PORT);
+  server.sin_addr.s_addr = mqttResolvedAddress;
+  if (lwip_connect(mqttSocket, (struct sockaddr*)&server, sizeof server) < 0 && errno != EINPROGRESS) {
+    mqttConnectFailed("TCP connect couldn't be started");
+  }
+}
+
+int mqttSocketConnected() { // -1 while the TCP connect is in progress, otherwise its result (0: connected)
+  fd_set writable;
+  FD_ZERO(&writable);
+  FD_SET(mqttSocket, &writable);
+  struct timeval now = {0, 0};
+  if (lwip_select(mqttSocket + 1, NULL, &writable, NULL, &now) <= 0) {
+    return -1;
   }
+  int       error  = 0;
+  socklen_t length = sizeof error;
+  lwip_getsockopt(mqttSocket, SOL_SOCKET, SO_ERROR, &error, &length);
+  return error;
 }
 
-bool initMQTT() { // Sets client encryption (TLS), initializes and connects to MQTT
+void mqttStartHandshake() { // Hands the connected socket to networkClient and sends CONNECT
+  int enable = 1;
+  lwip_fcntl(mqttSocket, F_SETFL, lwip_fcntl(mqttSocket, F_GETFL, 0) & ~O_NONBLOCK); // WiFiClient expects a blocking socket
+  lwip_setsockopt(mqttSocket, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof enable);
+  lwip_setsockopt(mqttSocket, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof enable);
+  networkClient = WiFiClient(mqttSocket); // Closes it on stop()
+  mqttSocket    = -1;
+  mqttEnterPhase(MQTT_PHASE_HANDSHAKE);
+  mqttClient.beginHandshake();
+  if (!mqtt.connect(MQTT_CLIENT_ID, MQTT_USERNAME, MQTT_PASSWORD) || !mqttClient.handshakeWritten()) {
+    mqttConnectFailed("CONNECT couldn't be sent");
+  }
+}
+
+void mqttSubscribe() { // Last phase, the connection is ready once this is done
+  mqttResendUnacknowledged();
+  mqttSubscribeTopics();
+  mqttEnterPhase(MQTT_PHASE_CONNECTED);
+  sp("[MQTT] Connected! Took (ms) to resolve: ");
+  sp(mqttPhaseTime[MQTT_PHASE_RESOLVE]);
+  sp(", connect: ");
+  sp(mqttPhaseTime[MQTT_PHASE_CONNECT]);
+  sp(", handshake: ");
+  sp(mqttPhaseTime[MQTT_PHASE_HANDSHAKE]);
+  sp(", subscribe: ");
+  spln(mqttPhaseTime[MQTT_PHASE_SUBSCRIBE]);
+  if (mqttConnectionLost) {
+    // TODO?: Turn off LED
+    mqttConnectionLost = false;
+    publishMetadata(true);
+  }
+  rgbEffect_GreenBlink = true;
+}
+
+void maintainMQTT() { // Takes the connection one phase further when it's ready to, otherwise loops MQTT client
+  int result;
+  switch (mqttPhase) {
+    case MQTT_PHASE_IDLE:
+      if (millis() - mqttReconnectLastAttempt >= mqttReconnectInterval * 1000) {
+        mqttStartResolve();
+      }
+      break;
+    case MQTT_PHASE_RESOLVE:
+      if (mqttResolveDone) {
+        if (mqttResolvedAddress) {
+          mqttStartConnect();
+        } else {
+          mqttConnectFailed("DNS lookup failed");
+        }
+      } else if (mqttPhaseTimedOut()) {
+        mqttConnectFailed("DNS lookup timed out");
+      }
+      break;
+    case MQTT_PHASE_CONNECT:
+      result = mqttSocketConnected();
+      if (result == 0) {
+        mqttStartHandshake();
+      } else if (result > 0) {
+        mqttConnectFailed(strerror(result));
+      } else if (mqttPhaseTimedOut()) {
+        mqttConnectFailed("TCP connect timed out");
+      }
+      break;
+    case MQTT_PHASE_HANDSHAKE:
+      result = mqttClient.handshakeReply();
+      if (result == 0) {
+        mqttEnterPhase(MQTT_PHASE_SUBSCRIBE);
+      } else if (result > 0) {
+        char reason[40];
+        snprintf(reason, sizeof reason, "Broker refused, CONNACK code %d", result);
+        mqttConnectFailed(reason);
+      } else if (!mqttClient.connected()) {
+        mqttConnectFailed("Connection closed before CONNACK");
+      } else if (mqttPhaseTimedOut()) {
+        mqttConnectFailed("No CONNACK");
+      }
+      break;
+    case MQTT_PHASE_SUBSCRIBE:
+      mqttSubscribe();
+      break;
+    default: // MQTT_PHASE_CONNECTED
+      if (mqtt.connected()) {
+        mqtt.loop();
+      } else {
+        spln("[MQTT] Lost Connection...");
+        mqttConnectionLost = true;
+        mqttEnterPhase(MQTT_PHASE_IDLE); // Retried right away unless the last attempt was less than mqttReconnectInterval ago
+      }
+      break;
+  }
+}
+
+void initMQTT() { // Sets client encryption (TLS) and initializes MQTT, maintainMQTT() connects
   //networkClient.setTimeout(3); // Questionable
   // TLS 1.2 Encryption
   // networkClient.setCACert(mqttRootCACertificate);
@@ -1549,9 +3185,10 @@ bool initMQTT() { // Sets client encryption (TLS), initializes and connects to M
   mqtt.setBufferSize(MQTT_MAX_MESSAGE_SIZE);
   mqtt.setServer(MQTT_SERVER, MQTT_PORT);
   mqtt.setCallback(mqttCallback);
+  initMqttCommands();
   //mqtt.setKeepAlive(15); // Period after which (if no data was flowing from/to the device) klimerko will send a "check" message to broker
   //mqtt.setSocketTimeout(5);
-  return connectMQTT();
+  mqttReconnectLastAttempt = millis() - mqttReconnectInterval * 1000; // First attempt right away
 }
 
 bool connectWiFi() {
@@ -1612,18 +3249,8 @@ void initWifiConfig() {
 }
 
 void initSensors() {
-  initSO2();
-  initNO2();
-  pms.init();
-  avgSo2.begin();
-  avgSo2Temp.begin();
-  avgSo2Hum.begin();
-  avgNo2.begin();
-  avgNo2Temp.begin();
-  avgNo2Hum.begin();
-  avgPM1.begin();
-  avgPM25.begin();
-  avgPM10.begin();
+  // Pinned to the core that isn't running loop(), sensor ports are opened there too so their interrupts stay on that core
+  xTaskCreatePinnedToCore(sensorTask, "sensors", sensorTaskStackSize, NULL, 1, &sensorTaskHandle, ARDUINO_RUNNING_CORE == 0 ? 1 : 0);
 }
 
 void initRGB() {
@@ -1723,6 +3350,8 @@ void setup() {
   generateKlimerkoID();    // Generate Unique ID and SSID
   esp_task_wdt_reset(); // Reset the watchdog timer so the device doesn't reboot
   initSensors();
+  initReadingStore();
+  initMetadata();
   initWifiConfig();        // Initialize WiFi Configuration Portal
   esp_task_wdt_reset(); // Reset the watchdog timer so the device doesn't reboot
   timeClient.begin();
@@ -1738,11 +3367,15 @@ void loop() {
     firmwareUpdateLoop();
     publishMetadataLoop();
     maintainMQTT();
+    mqttCommandLoop();
+    readingStoreLoop();
   }
   maintainWiFi();
   rgbLoop();
   wifiConfigButton();
   wifiConfigLoop();
+  processSensorEvents();
+  sensorRollupLoop();
   if (!wm.getConfigPortalActive()) {
     publishSensorDataLoop(); // Don't read and publish sensor data if WiFi Configuration Mode is active (hangs)
   }
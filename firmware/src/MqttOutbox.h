@@ -0,0 +1,194 @@
+#pragma once
+
+// QoS 1 PUBLISH packets that were sent but not acknowledged (PUBACK) yet, so several can be in flight at once.
+// Each one is kept fully encoded in one of 'Slots' slots of 'Size' bytes, so after a reconnect it's sent again as it is,
+// with the DUP flag set. PubSubClient ignores PUBACK, so the acknowledgements are found by scanning the bytes the MQTT
+// client reads from the connection (received()). Has no Arduino dependencies.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+template <size_t Slots, size_t Size>
+class MqttOutbox {
+  public:
+    MqttOutbox() : _nextId(1), _order(0), _pending(Slots), _resent(0) {
+      for (size_t i = 0; i < Slots; i++) {
+        _slots[i].used = false;
+      }
+      resetStream();
+    }
+
+    // Encodes a QoS 1 PUBLISH with a 'length' byte payload into a free slot and returns where the payload goes (with room
+    // for one more byte, e.g. a serializer's terminating zero). NULL if all slots are in flight or the packet doesn't fit.
+    uint8_t* begin(const char* topic, bool retained, size_t length) {
+      _pending = Slots;
+      for (size_t i = 0; i < Slots && _pending == Slots; i++) {
+        if (!_slots[i].used) {
+          _pending = i;
+        }
+      }
+      size_t topicLength = strlen(topic);
+      size_t remaining   = 2 + topicLength + 2 + length;
+      if (_pending == Slots || remaining + 5 + 1 > Size) {
+        _pending = Slots;
+        return NULL;
+      }
+      Slot    &slot = _slots[_pending];
+      uint8_t *data = slot.data;
+      *data++ = 0x32 | (retained ? 0x01 : 0x00); // PUBLISH, QoS 1
+      do { // Remaining length
+        uint8_t digit = remaining % 128;
+        remaining /= 128;
+        *data++ = remaining ? digit | 0x80 : digit;
+      } while (remaining);
+      while (inFlight(_nextId) || !_nextId) {
+        _nextId++;
+      }
+      slot.id = _nextId++;
+      *data++ = topicLength >> 8;
+      *data++ = topicLength & 0xFF;
+      memcpy(data, topic, topicLength);
+      data += topicLength;
+      *data++ = slot.id >> 8;
+      *data++ = slot.id & 0xFF;
+      slot.length = (data - slot.data) + length;
+      return data;
+    }
+
+    // Takes the packet started with begin() into flight and returns it to be sent, NULL if there was none
+    const uint8_t* commit(size_t &length) {
+      if (_pending == Slots) {
+        return NULL;
+      }
+      Slot &slot = _slots[_pending];
+      _pending   = Slots;
+      slot.used  = true;
+      slot.order = _order++;
+      length     = slot.length;
+      return slot.data;
+    }
+
+    // Calls send(packet, length) for every packet in flight, oldest first, with the DUP flag set (after a reconnect)
+    template <typename Send>
+    void resend(Send send) {
+      Slot  *order[Slots];
+      size_t count = 0;
+      for (size_t i = 0; i < Slots; i++) {
+        if (!_slots[i].used) {
+          continue;
+        }
+        size_t j = count++;
+        for (; j > 0 && (int32_t)(_slots[i].order - order[j - 1]->order) < 0; j--) {
+          order[j] = order[j - 1];
+        }
+        order[j] = &_slots[i];
+      }
+      for (size_t i = 0; i < count; i++) {
+        order[i]->data[0] |= 0x08;
+        send((const uint8_t*)order[i]->data, order[i]->length);
+        _resent++;
+      }
+    }
+
+    // Feeds one byte read from the connection, PUBACKs free their slot
+    void received(uint8_t byte) {
+      switch (_state) {
+        case STREAM_HEADER:
+          _type       = byte >> 4;
+          _remaining  = 0;
+          _multiplier = 1;
+          _state      = STREAM_LENGTH;
+          break;
+        case STREAM_LENGTH:
+          _remaining  += (byte & 0x7F) * _multiplier;
+          _multiplier *= 128;
+          if (!(byte & 0x80)) {
+            _position = 0;
+            _id       = 0;
+            _state    = _remaining ? STREAM_BODY : STREAM_HEADER;
+          }
+          break;
+        case STREAM_BODY:
+          if (_position < 2) {
+            _id = (_id << 8) | byte;
+          }
+          if (++_position == _remaining) {
+            if (_type == PACKET_PUBACK) {
+              acknowledge(_id);
+            }
+            _state = STREAM_HEADER;
+          }
+          break;
+      }
+    }
+
+    // A new connection starts with a new packet
+    void resetStream() {
+      _state = STREAM_HEADER;
+    }
+
+    size_t inFlight() const {
+      size_t count = 0;
+      for (size_t i = 0; i < Slots; i++) {
+        count += _slots[i].used;
+      }
+      return count;
+    }
+
+    bool full() const {
+      return inFlight() == Slots;
+    }
+
+    uint32_t resent() const { // Packets sent again since boot
+      return _resent;
+    }
+
+  private:
+    enum : uint8_t {
+      PACKET_PUBACK = 4
+    };
+
+    enum StreamState : uint8_t {
+      STREAM_HEADER,
+      STREAM_LENGTH,
+      STREAM_BODY
+    };
+
+    struct Slot {
+      bool     used;
+      uint16_t id;
+      uint32_t order;  // When it was first sent, relative to the others
+      size_t   length;
+      uint8_t  data[Size];
+    };
+
+    bool inFlight(uint16_t id) const {
+      for (size_t i = 0; i < Slots; i++) {
+        if (_slots[i].used && _slots[i].id == id) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    void acknowledge(uint16_t id) {
+      for (size_t i = 0; i < Slots; i++) {
+        if (_slots[i].used && _slots[i].id == id) {
+          _slots[i].used = false;
+        }
+      }
+    }
+
+    Slot        _slots[Slots];
+    uint16_t    _nextId;
+    uint32_t    _order;
+    size_t      _pending;    // Slot started with begin(), Slots if none
+    uint32_t    _resent;
+    StreamState _state;
+    uint8_t     _type;
+    uint32_t    _remaining;
+    uint32_t    _multiplier;
+    uint32_t    _position;
+    uint16_t    _id;
+};
@@ -0,0 +1,26 @@
+#pragma once
+
+// Converts an ArduinoJson document to its compact-key form (PayloadSchema.h) for MessagePack payloads.
+// Only needs ArduinoJson, so the host tests can compare the JSON and MessagePack encodings of the same message.
+
+#include <ArduinoJson.h>
+#include "PayloadSchema.h"
+
+inline void payloadCompact(JsonVariantConst source, JsonVariant target) { // Copies 'source' with the keys shortened (PayloadSchema.h)
+  if (source.is<JsonObjectConst>()) {
+    JsonObject object = target.to<JsonObject>();
+    for (JsonPairConst pair : source.as<JsonObjectConst>()) {
+      char buffer[16];
+      const char* key = payloadCompactKey(pair.key().c_str(), buffer, sizeof buffer);
+      // A composed key is copied into the document (char*), the others are linked
+      payloadCompact(pair.value(), key == buffer ? object.getOrAddMember(buffer) : object.getOrAddMember(key));
+    }
+  } else if (source.is<JsonArrayConst>()) {
+    JsonArray array = target.to<JsonArray>();
+    for (JsonVariantConst element : source.as<JsonArrayConst>()) {
+      payloadCompact(element, array.add());
+    }
+  } else {
+    target.set(source);
+  }
+}
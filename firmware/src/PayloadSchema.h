@@ -0,0 +1,146 @@
+#pragma once
+
+// Compact keys for MessagePack payloads (schema version PAYLOAD_SCHEMA_VERSION).
+// A key is looked up as a whole first. Otherwise, if it's "<prefix>_<rest>" with a known prefix and a known rest,
+// it becomes "<short prefix>_<short rest>" (e.g. "so2_uart_rx_bytes" -> "s_urb"). Any other key is kept as it is.
+// Changing or removing an entry breaks decoders, so that takes a new schema version. Adding entries does too, since
+// older decoders wouldn't know the new short key. The README points decoders to these tables.
+// payloadLongKey() maps compact keys back, it's what a decoder does and what the host tests check the tables with.
+// Has no Arduino dependencies so decoders can be checked against it on the host.
+
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#define PAYLOAD_SCHEMA_VERSION 1
+
+struct PayloadKey {
+  const char* name;
+  const char* key;
+};
+
+const PayloadKey payloadPrefixes[] = {
+  { "device", "d" },
+  { "so2",    "s" },
+  { "no2",    "n" },
+  { "pms",    "p" },
+};
+
+const PayloadKey payloadKeys[] = {
+  // Message
+  { "type",                      "ty"  },
+  { "client_id",                 "c"   },
+  { "correlation_id",            "ci"  },
+  { "sent_at",                   "t"   },
+  { "window_start",              "ws"  },
+  { "window_end",                "we"  },
+  { "stored",                    "sto" },
+  { "readings",                  "rd"  },
+  { "data",                      "d"   },
+  // Sensor data
+  { "temperature",               "te"  },
+  { "humidity",                  "h"   },
+  { "aqi_pollutant",             "aqp" },
+  { "adc",                       "a"   },
+  { "coverage",                  "cv"  },
+  // Sensors (after a prefix)
+  { "online",                    "o"   },
+  { "ready",                     "r"   },
+  { "active_time",               "at"  },
+  { "serial",                    "sn"  },
+  { "fw_version",                "fv"  },
+  { "last_zeroing",              "lz"  },
+  { "last_failed_zeroing",       "lfz" },
+  { "uart",                      "u"   },
+  { "uart_rx_bytes",             "urb" },
+  { "uart_framing_errors",       "ufe" },
+  { "uart_parity_errors",        "upe" },
+  { "uart_overflows",            "uo"  },
+  { "recovery_attempts",         "ra"  },
+  { "recovery_successes",        "rs"  },
+  { "offline_time",              "ot"  },
+  { "outliers",                  "ol"  },
+  { "temperature_outliers",      "tol" },
+  { "humidity_outliers",         "hol" },
+  { "pm1_outliers",              "p1o" },
+  { "pm2_5_outliers",            "p25o" },
+  { "pm10_outliers",             "p10o" },
+  // Device (after the "device" prefix)
+  { "fw",                        "fw"  },
+  { "wifi_rssi",                 "rssi" },
+  { "free_heap",                 "fh"  },
+  { "flash_size",                "fs"  },
+  { "sketch_used",               "sku" },
+  { "sketch_total",              "skt" },
+  { "last_successful_ota",       "lso" },
+  { "last_failed_ota",           "lfo" },
+  { "last_reset_reason",         "rr"  },
+  { "sensor_read_interval",      "ri"  },
+  { "sensor_publish_interval",   "pi"  },
+  { "sensor_batch_size",         "bs"  },
+  { "sensor_streaming",          "st"  },
+  { "read_cycle_latency",        "cl"  },
+  { "read_cycle_latency_avg",    "cla" },
+  { "read_cycle_latency_max",    "clm" },
+  { "read_cycle_deadline_misses", "cdm" },
+  { "store_pending",             "sp"  },
+  { "store_high_water_mark",     "shw" },
+  { "store_dropped",             "sd"  },
+};
+
+inline const char* payloadKeyLookup(const PayloadKey *keys, size_t count, const char* name, size_t length) {
+  for (size_t i = 0; i < count; i++) {
+    if (strlen(keys[i].name) == length && !strncmp(keys[i].name, name, length)) {
+      return keys[i].key;
+    }
+  }
+  return NULL;
+}
+
+// Returns the compact key for 'name': one of the table entries, 'buffer' (if it's composed) or 'name' itself
+inline const char* payloadCompactKey(const char* name, char* buffer, size_t size) {
+  const size_t prefixCount = sizeof payloadPrefixes / sizeof payloadPrefixes[0];
+  const size_t keyCount    = sizeof payloadKeys / sizeof payloadKeys[0];
+  const char*  key         = payloadKeyLookup(payloadKeys, keyCount, name, strlen(name));
+  if (key) {
+    return key;
+  }
+  const char* separator = strchr(name, '_');
+  if (separator) {
+    const char* prefix = payloadKeyLookup(payloadPrefixes, prefixCount, name, separator - name);
+    const char* rest   = payloadKeyLookup(payloadKeys, keyCount, separator + 1, strlen(separator + 1));
+    if (prefix && rest && snprintf(buffer, size, "%s_%s", prefix, rest) < (int)size) {
+      return buffer;
+    }
+  }
+  return name;
+}
+
+inline const char* payloadNameLookup(const PayloadKey *keys, size_t count, const char* key, size_t length) {
+  for (size_t i = 0; i < count; i++) {
+    if (strlen(keys[i].key) == length && !strncmp(keys[i].key, key, length)) {
+      return keys[i].name;
+    }
+  }
+  return NULL;
+}
+
+// Reverse of payloadCompactKey(): returns the long name for 'key', one of the table entries, 'buffer' (if it's composed)
+// or 'key' itself
+inline const char* payloadLongKey(const char* key, char* buffer, size_t size) {
+  const size_t prefixCount = sizeof payloadPrefixes / sizeof payloadPrefixes[0];
+  const size_t keyCount    = sizeof payloadKeys / sizeof payloadKeys[0];
+  const char*  name        = payloadNameLookup(payloadKeys, keyCount, key, strlen(key));
+  if (name) {
+    return name;
+  }
+  const char* separator = strchr(key, '_');
+  if (separator) {
+    const char* prefix = payloadNameLookup(payloadPrefixes, prefixCount, key, separator - key);
+    const char* rest   = payloadNameLookup(payloadKeys, keyCount, separator + 1, strlen(separator + 1));
+    if (prefix && rest && snprintf(buffer, size, "%s_%s", prefix, rest) < (int)size) {
+      return buffer;
+    }
+  }
+  return key;
+}
@@ -0,0 +1,228 @@
+#pragma once
+
+// Persistent FIFO of fixed-size records in raw flash, used as a ring of erase sectors.
+// Every record takes a 64 byte slot: sequence number, state, layout, CRC and the record itself. Slots are only ever written once
+// after their sector is erased, and a record is marked as sent by clearing bits of its state byte (1 -> 0), so no slot
+// is rewritten before its sector comes around again. When the ring is full, the oldest sector is erased and the unsent
+// records in it are dropped (and counted). The head and tail are recovered at boot by scanning the slot headers.
+// If a header isn't one this class writes (e.g. a file system left in the partition of a new device), the whole ring is
+// erased instead of trusting any of it.
+// 'Record' has a layout number and the size of every layout it had (Record::layout, Record::layoutSize()), so records stored
+// before fields were added to it are still read (the new fields are zero).
+// 'Storage' provides read/write/erase by byte address (e.g. on top of an ESP32 partition), so this has no Arduino dependencies.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define RECORD_RING_SECTOR_SIZE 4096
+#define RECORD_RING_SLOT_SIZE   64
+
+template <typename Storage, typename Record>
+class RecordRing {
+  public:
+    RecordRing(Storage &storage) : _storage(storage), _slots(0), _head(0), _tail(0), _sequence(0), _pending(0), _highWaterMark(0), _dropped(0) {}
+
+    // Takes over 'sectors' sectors from the start of the storage and finds the records that haven't been sent yet.
+    // Returns false if the storage held anything else, it's erased then.
+    bool begin(size_t sectors) {
+      _slots    = sectors * slotsPerSector;
+      _head     = 0;
+      _tail     = 0;
+      _sequence = 0;
+      _pending  = 0;
+      bool     found  = false;
+      uint32_t oldest = 0;
+      for (size_t slot = 0; slot < _slots; slot++) {
+        Header header;
+        if (!_storage.read(slot * RECORD_RING_SLOT_SIZE, &header, sizeof header)) {
+          continue;
+        }
+        if (!valid(header)) {
+          for (size_t sector = 0; sector < sectors; sector++) {
+            _storage.erase(sector * RECORD_RING_SECTOR_SIZE, RECORD_RING_SECTOR_SIZE);
+          }
+          _head          = 0;
+          _tail          = 0;
+          _sequence      = 0;
+          _pending       = 0;
+          _highWaterMark = 0;
+          return false;
+        }
+        if (header.state == STATE_ERASED) {
+          continue;
+        }
+        if (!found || (int32_t)(header.sequence - (_sequence - 1)) > 0) { // Newest so far, the next record goes after it
+          _sequence = header.sequence + 1;
+          _head     = (slot + 1) % _slots;
+          found     = true;
+        }
+        if (header.state == STATE_UNSENT) {
+          if (!_pending || (int32_t)(header.sequence - oldest) < 0) {
+            oldest = header.sequence;
+            _tail  = slot;
+          }
+          _pending++;
+        }
+      }
+      if (!_pending) {
+        _tail = _head;
+      }
+      _highWaterMark = _pending;
+      return true;
+    }
+
+    // Appends a record, erasing the oldest sector first if the ring is full
+    bool push(const Record &record) {
+      if (!_slots) {
+        return false;
+      }
+      if (_head % slotsPerSector == 0) {
+        eraseSector(_head);
+      }
+      Slot slot;
+      memset(&slot, 0xFF, sizeof slot);
+      slot.header.sequence = _sequence;
+      slot.header.state    = STATE_UNSENT;
+      slot.header.layout   = Record::layout;
+      memcpy(slot.record, &record, sizeof record);
+      slot.header.crc      = crc(slot.header.sequence, slot.record, sizeof record);
+      if (!_storage.write(_head * RECORD_RING_SLOT_SIZE, &slot, sizeof slot)) {
+        _dropped++;
+        return false;
+      }
+      if (!_pending) {
+        _tail = _head;
+      }
+      _sequence++;
+      _head = (_head + 1) % _slots;
+      _pending++;
+      if (_pending > _highWaterMark) {
+        _highWaterMark = _pending;
+      }
+      return true;
+    }
+
+    // Oldest record that hasn't been sent yet. Records that fail the CRC check are dropped.
+    bool peek(Record &record) {
+      for (size_t checked = 0; _pending && checked < _slots; checked++) {
+        Slot slot;
+        if (_storage.read(_tail * RECORD_RING_SLOT_SIZE, &slot, sizeof slot) && slot.header.state == STATE_UNSENT) {
+          size_t size = recordSize(slot.header);
+          if (size && slot.header.crc == crc(slot.header.sequence, slot.record, size)) {
+            memset(&record, 0, sizeof record);
+            memcpy(&record, slot.record, size);
+            return true;
+          }
+          _pending--;
+          _dropped++;
+        }
+        _tail = (_tail + 1) % _slots;
+      }
+      _pending = 0; // Counts were off (e.g. a write was interrupted by a reset), nothing unsent is left
+      _tail    = _head;
+      return false;
+    }
+
+    // Marks the record returned by peek() as sent
+    void pop() {
+      if (!_pending) {
+        return;
+      }
+      uint8_t state = STATE_SENT;
+      _storage.write(_tail * RECORD_RING_SLOT_SIZE + offsetof(Header, state), &state, 1);
+      _pending--;
+      _tail = _pending ? (_tail + 1) % _slots : _head;
+    }
+
+    uint32_t pending() const {
+      return _pending;
+    }
+
+    uint32_t capacity() const {
+      return _slots;
+    }
+
+    uint32_t highWaterMark() const { // Most records pending at once since boot
+      return _highWaterMark;
+    }
+
+    uint32_t dropped() const { // Since boot
+      return _dropped;
+    }
+
+  private:
+    enum : uint8_t {
+      STATE_ERASED = 0xFF,
+      STATE_UNSENT = 0xFE,
+      STATE_SENT   = 0xFC
+    };
+
+    struct Header {
+      uint32_t sequence;
+      uint8_t  state;
+      uint8_t  layout;   // Record::layout it was written with, LAYOUT_UNSET if it was written before layouts were kept
+      uint16_t crc;      // Of the sequence number and the record, as long as its layout is
+    };
+
+    static const uint8_t LAYOUT_UNSET = 0xFF; // Byte was left erased, the record has layout 1
+
+    struct Slot {
+      Header  header;
+      uint8_t record[RECORD_RING_SLOT_SIZE - sizeof(Header)];
+    };
+
+    static_assert(sizeof(Record) <= RECORD_RING_SLOT_SIZE - sizeof(Header), "Record doesn't fit in a slot");
+    static_assert(Record::layout != LAYOUT_UNSET, "Layout number is reserved");
+
+    // Size of the record in a slot, 0 if its layout isn't known
+    static size_t recordSize(const Header &header) {
+      return Record::layoutSize(header.layout == LAYOUT_UNSET ? 1 : header.layout);
+    }
+
+    // Erased (the rest of the header isn't checked, a write may have been cut short there), or written by push()
+    static bool valid(const Header &header) {
+      return header.state == STATE_ERASED || ((header.state == STATE_UNSENT || header.state == STATE_SENT) && recordSize(header));
+    }
+    static const size_t slotsPerSector = RECORD_RING_SECTOR_SIZE / RECORD_RING_SLOT_SIZE;
+
+    // Unsent records in the sector that's about to be erased are lost
+    void eraseSector(size_t first) {
+      if (_pending) {
+        for (size_t slot = first; slot < first + slotsPerSector; slot++) {
+          Header header;
+          if (_storage.read(slot * RECORD_RING_SLOT_SIZE, &header, sizeof header) && header.state == STATE_UNSENT) {
+            _pending--;
+            _dropped++;
+          }
+        }
+        if (_tail >= first && _tail < first + slotsPerSector) {
+          _tail = (first + slotsPerSector) % _slots; // Oldest sector left
+        }
+      }
+      _storage.erase(first * RECORD_RING_SLOT_SIZE, RECORD_RING_SECTOR_SIZE);
+    }
+
+    // CRC-16/CCITT-FALSE
+    static uint16_t crc(uint32_t sequence, const uint8_t *record, size_t size) {
+      uint16_t value = 0xFFFF;
+      uint8_t  bytes[sizeof sequence];
+      memcpy(bytes, &sequence, sizeof sequence);
+      for (size_t i = 0; i < sizeof bytes + size; i++) {
+        value ^= (uint16_t)(i < sizeof bytes ? bytes[i] : record[i - sizeof bytes]) << 8;
+        for (uint8_t bit = 0; bit < 8; bit++) {
+          value = value & 0x8000 ? (value << 1) ^ 0x1021 : value << 1;
+        }
+      }
+      return value;
+    }
+
+    Storage &_storage;
+    size_t   _slots;
+    size_t   _head;          // Next slot to write
+    size_t   _tail;          // Oldest unsent record
+    uint32_t _sequence;      // Of the next record
+    uint32_t _pending;
+    uint32_t _highWaterMark;
+    uint32_t _dropped;
+};
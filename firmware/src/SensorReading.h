@@ -0,0 +1,54 @@
+#pragma once
+
+// One window of published sensor data in a fixed binary layout, so it can be kept in flash until it's sent (store-and-forward).
+// The layout is stored as is: fields may only be added at the end (and the record must still fit a RecordRing slot).
+// Adding fields takes a new layout number and its size in layoutSize(), records stored with an older layout are then
+// read with the new fields zeroed. Has no Arduino dependencies.
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum SensorReadingFlags : uint16_t {
+  READING_SO2          = 1 << 0, // so2, so2Adc and so2Coverage are valid
+  READING_SO2_READY    = 1 << 1,
+  READING_NO2          = 1 << 2, // no2, no2Adc and no2Coverage are valid
+  READING_NO2_READY    = 1 << 3,
+  READING_PMS          = 1 << 4, // pm1, pm2_5, pm10 and pmsCoverage are valid
+  READING_CLIMATE      = 1 << 5, // temperature and humidity are valid
+  READING_CLIMATE_SO2  = 1 << 6, // Temperature and humidity are from the SO2 sensor (NO2 was offline)
+  READING_WINDOW       = 1 << 7, // Averaged over a wall-clock window, windowStart and coverages are valid
+  READING_SAMPLED      = 1 << 8  // sampledAt is valid
+};
+
+struct SensorReading {
+  static const uint8_t layout = 2;
+  static size_t layoutSize(uint8_t layout);
+
+  uint32_t time;         // [epoch seconds] When the reading was taken (published or stored)
+  uint32_t windowStart;  // [epoch seconds]
+  uint16_t windowLength; // [seconds]
+  uint16_t flags;        // SensorReadingFlags
+  int32_t  so2;          // ug/m3
+  int32_t  so2Adc;
+  int32_t  no2;          // ug/m3
+  int32_t  no2Adc;
+  uint16_t pm1;          // ug/m3
+  uint16_t pm2_5;
+  uint16_t pm10;
+  int16_t  temperature;  // °C
+  int16_t  humidity;     // %
+  uint8_t  so2Coverage;  // [%]
+  uint8_t  no2Coverage;
+  uint8_t  pmsCoverage;
+  uint32_t sampledAt;       // [epoch seconds] When the newest sample in the reading was read
+  uint16_t sampledAtMillis; // [ms]
+};
+
+// Bytes of each layout the reading was ever stored with, 0 if 'layout' isn't one of them
+inline size_t SensorReading::layoutSize(uint8_t layout) {
+  switch (layout) {
+    case 1:  return offsetof(SensorReading, sampledAt); // Before sampledAt and sampledAtMillis were added
+    case 2:  return sizeof(SensorReading);
+    default: return 0;
+  }
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+// Schedules attempts to bring an offline sensor back, with capped exponential backoff and jitter.
+// A permanently unplugged sensor is then only checked every few tens of minutes instead of every couple of minutes forever,
+// while a sensor that comes back can still be picked up right away (see sensorRecoveryWake()).
+// All times are in milliseconds (millis()). Has no Arduino dependencies so it can be compiled on the host.
+// The offline time is added up at every attempt, which are at most maxDelay apart, so it stays right when millis() wraps
+// (every 49.7 days) during a long outage.
+
+#include <stdint.h>
+
+struct SensorRecovery {
+  uint32_t minDelay;      // Delay after the first failed attempt
+  uint32_t maxDelay;      // Delay never grows above this
+  bool     offline;
+  uint32_t delay;         // Current delay between attempts, doubles after every failed attempt
+  uint32_t nextAttempt;
+  uint32_t offlineCounted; // Current outage is added to offlineTime up to here
+  uint64_t offlineTime;    // Total time spent offline
+  uint32_t attempts;
+  uint32_t successes;
+};
+
+// Online sensor with the given delays, everything else zeroed
+inline SensorRecovery sensorRecoveryMake(uint32_t minDelay, uint32_t maxDelay) {
+  SensorRecovery recovery = {};
+  recovery.minDelay = minDelay;
+  recovery.maxDelay = maxDelay;
+  return recovery;
+}
+
+// Sensor was just considered offline
+inline void sensorRecoveryStart(SensorRecovery &recovery, uint32_t now) {
+  if (recovery.offline) {
+    return;
+  }
+  recovery.offline        = true;
+  recovery.offlineCounted = now;
+  recovery.delay        = 0;
+  recovery.nextAttempt  = now;
+}
+
+inline void sensorRecoveryCountOffline(SensorRecovery &recovery, uint32_t now) {
+  if (recovery.offline) {
+    recovery.offlineTime   += now - recovery.offlineCounted;
+    recovery.offlineCounted = now;
+  }
+}
+
+// Attempt (or the check that made the sensor offline) failed, schedules the next one. 'random' is any random number.
+inline void sensorRecoveryFailed(SensorRecovery &recovery, uint32_t now, uint32_t random) {
+  sensorRecoveryStart(recovery, now);
+  sensorRecoveryCountOffline(recovery, now);
+  if (recovery.delay == 0) {
+    recovery.delay = recovery.minDelay;
+  } else if (recovery.delay < recovery.maxDelay / 2) {
+    recovery.delay *= 2;
+  } else {
+    recovery.delay = recovery.maxDelay;
+  }
+  uint32_t jitter = recovery.delay / 4; // ±25 %, so sensors (and devices) that failed together don't keep retrying together
+  recovery.nextAttempt = now + recovery.delay - jitter + random % (2 * jitter + 1);
+}
+
+inline bool sensorRecoveryDue(const SensorRecovery &recovery, uint32_t now) {
+  return recovery.offline && (int32_t)(now - recovery.nextAttempt) >= 0;
+}
+
+inline void sensorRecoveryAttempted(SensorRecovery &recovery) {
+  recovery.attempts++;
+}
+
+// Fast path, e.g. when data shows up on the sensor's port: the next attempt is due right away
+inline void sensorRecoveryWake(SensorRecovery &recovery, uint32_t now) {
+  if (recovery.offline) {
+    recovery.nextAttempt = now;
+  }
+}
+
+inline void sensorRecoverySucceeded(SensorRecovery &recovery, uint32_t now) {
+  if (!recovery.offline) {
+    return;
+  }
+  sensorRecoveryCountOffline(recovery, now);
+  recovery.offline = false;
+  recovery.delay   = 0;
+  recovery.successes++;
+}
+
+// Total time spent offline in seconds, including the current outage
+inline uint32_t sensorRecoveryOfflineSeconds(const SensorRecovery &recovery, uint32_t now) {
+  return (recovery.offlineTime + (recovery.offline ? now - recovery.offlineCounted : 0)) / 1000;
+}
@@ -0,0 +1,146 @@
+#pragma once
+
+// Cascaded rollups of time-weighted averages: 1 minute -> 15 minutes -> 1 hour -> 24 hours, for a fixed set of channels.
+// Completed minutes (value * milliseconds and covered milliseconds, e.g. from a TimeWeightedWindow) are added as they end.
+// A quarter is summed from its minutes when its last minute is added, an hour from its quarters, and the 24 hour total
+// is kept as a running sum over the ring of the last 24 hours, so every level is updated incrementally and memory is fixed.
+// Buckets are aligned to the wall clock (minutes since epoch). Missing minutes count as not covered.
+// Has no Arduino dependencies so it can be compiled on the host.
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum RollupLevel : uint8_t {
+  ROLLUP_1M,  // Last completed minute
+  ROLLUP_15M, // Last completed quarter of an hour
+  ROLLUP_1H,  // Last completed hour
+  ROLLUP_24H, // Last 24 completed hours
+  ROLLUP_LEVEL_COUNT
+};
+
+template <size_t N>
+class SensorRollup {
+  public:
+    SensorRollup() : _started(false), _minute(0) {
+      clear();
+    }
+
+    // Adds the completed minute 'minute' (minutes since epoch). Minutes must be added in order, older ones are ignored.
+    void addMinute(uint32_t minute, const int64_t *sums, const uint32_t *covered) {
+      if (_started && (int32_t)(minute - _minute) <= 0) {
+        return;
+      }
+      if (!_started || minute - _minute > 24 * 60) { // Nothing left of the last 24 hours
+        clear();
+      } else {
+        for (uint32_t skipped = _minute + 1; skipped != minute; skipped++) {
+          store(skipped, NULL, NULL);
+        }
+      }
+      store(minute, sums, covered);
+      _started = true;
+    }
+
+    // Milliseconds covered by samples in the last completed bucket of 'level'
+    uint32_t covered(RollupLevel level, size_t channel) const {
+      switch (level) {
+        case ROLLUP_1M:  return _minuteCovered[channel][_minute % 15];
+        case ROLLUP_15M: return _quarterCovered[channel][_quarter % 4];
+        case ROLLUP_1H:  return _hourCovered[channel][_hour % 24];
+        default:         return _dayCovered[channel];
+      }
+    }
+
+    // Percentage of the bucket covered by samples
+    uint8_t coverage(RollupLevel level, size_t channel) const {
+      static const uint32_t lengths[ROLLUP_LEVEL_COUNT] = { 60000UL, 900000UL, 3600000UL, 86400000UL };
+      return (uint8_t)(((uint64_t)covered(level, channel) * 100 + lengths[level] / 2) / lengths[level]);
+    }
+
+    // Only meaningful if covered() > 0
+    float mean(RollupLevel level, size_t channel) const {
+      uint32_t time = covered(level, channel);
+      int64_t  sum;
+      switch (level) {
+        case ROLLUP_1M:  sum = _minuteSum[channel][_minute % 15]; break;
+        case ROLLUP_15M: sum = _quarterSum[channel][_quarter % 4]; break;
+        case ROLLUP_1H:  sum = _hourSum[channel][_hour % 24]; break;
+        default:         sum = _daySum[channel]; break;
+      }
+      return time ? (float)sum / time : 0;
+    }
+
+  private:
+    void clear() {
+      for (size_t i = 0; i < N; i++) {
+        for (size_t j = 0; j < 15; j++) { _minuteSum[i][j] = 0;  _minuteCovered[i][j] = 0; }
+        for (size_t j = 0; j < 4; j++)  { _quarterSum[i][j] = 0; _quarterCovered[i][j] = 0; }
+        for (size_t j = 0; j < 24; j++) { _hourSum[i][j] = 0;    _hourCovered[i][j] = 0; }
+        _daySum[i]     = 0;
+        _dayCovered[i] = 0;
+      }
+      _quarter = 0;
+      _hour    = 0;
+    }
+
+    // 'sums' and 'covered' are NULL for a minute without samples
+    void store(uint32_t minute, const int64_t *sums, const uint32_t *covered) {
+      size_t slot = minute % 15;
+      for (size_t i = 0; i < N; i++) {
+        _minuteSum[i][slot]     = sums ? sums[i] : 0;
+        _minuteCovered[i][slot] = covered ? covered[i] : 0;
+      }
+      _minute = minute;
+      if (slot == 14) {
+        closeQuarter(minute / 15);
+      }
+    }
+
+    void closeQuarter(uint32_t quarter) {
+      size_t slot = quarter % 4;
+      for (size_t i = 0; i < N; i++) {
+        int64_t  sum  = 0;
+        uint32_t time = 0;
+        for (size_t j = 0; j < 15; j++) {
+          sum  += _minuteSum[i][j];
+          time += _minuteCovered[i][j];
+        }
+        _quarterSum[i][slot]     = sum;
+        _quarterCovered[i][slot] = time;
+      }
+      _quarter = quarter;
+      if (slot == 3) {
+        closeHour(quarter / 4);
+      }
+    }
+
+    void closeHour(uint32_t hour) {
+      size_t slot = hour % 24;
+      for (size_t i = 0; i < N; i++) {
+        int64_t  sum  = 0;
+        uint32_t time = 0;
+        for (size_t j = 0; j < 4; j++) {
+          sum  += _quarterSum[i][j];
+          time += _quarterCovered[i][j];
+        }
+        _daySum[i]     += sum - _hourSum[i][slot]; // The hour 24 hours ago leaves the running total
+        _dayCovered[i] += time - _hourCovered[i][slot];
+        _hourSum[i][slot]     = sum;
+        _hourCovered[i][slot] = time;
+      }
+      _hour = hour;
+    }
+
+    bool     _started;
+    uint32_t _minute;  // Last added
+    uint32_t _quarter; // Last closed
+    uint32_t _hour;    // Last closed
+    int64_t  _minuteSum[N][15];  // Value * milliseconds
+    uint32_t _minuteCovered[N][15];
+    int64_t  _quarterSum[N][4];
+    uint32_t _quarterCovered[N][4];
+    int64_t  _hourSum[N][24];
+    uint32_t _hourCovered[N][24];
+    int64_t  _daySum[N];
+    uint32_t _dayCovered[N];
+};
@@ -0,0 +1,79 @@
+#pragma once
+
+// Streaming statistics (count, mean, min, max, standard deviation) for a fixed set of measurement channels.
+// Uses Welford's algorithm, so every sample is an O(1) update and nothing is stored per sample. Memory is fixed at compile time.
+// Channels are kept as a struct of arrays, so a sensor that measures several channels at once (e.g. concentration,
+// temperature and humidity) updates all of them in one loop over adjacent entries. Has no Arduino dependencies.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <math.h>
+
+template <size_t N>
+class SensorStats {
+  public:
+    SensorStats() {
+      reset(0, N);
+    }
+
+    void reset(size_t first, size_t channels) {
+      for (size_t i = first; i < first + channels; i++) {
+        _count[i] = 0;
+        _mean[i]  = 0;
+        _m2[i]    = 0;
+        _min[i]   = INT32_MAX;
+        _max[i]   = INT32_MIN;
+      }
+    }
+
+    void reset() {
+      reset(0, N);
+    }
+
+    // Adds one sample to each of the channels first..first+channels-1
+    void add(size_t first, const int32_t *values, size_t channels) {
+      for (size_t i = first, v = 0; v < channels; i++, v++) {
+        float value = values[v];
+        float delta = value - _mean[i];
+        _count[i]++;
+        _mean[i] += delta / _count[i];
+        _m2[i]   += delta * (value - _mean[i]);
+        if (values[v] < _min[i]) _min[i] = values[v];
+        if (values[v] > _max[i]) _max[i] = values[v];
+      }
+    }
+
+    uint32_t count(size_t channel) const {
+      return _count[channel];
+    }
+
+    float mean(size_t channel) const {
+      return _mean[channel];
+    }
+
+    // Mean rounded to the nearest integer (half away from zero)
+    int32_t roundedMean(size_t channel) const {
+      return (int32_t)lroundf(_mean[channel]);
+    }
+
+    // Only meaningful if count() > 0
+    int32_t minimum(size_t channel) const {
+      return _min[channel];
+    }
+
+    int32_t maximum(size_t channel) const {
+      return _max[channel];
+    }
+
+    // Sample standard deviation, 0 until there are at least two samples
+    float stddev(size_t channel) const {
+      return _count[channel] > 1 ? sqrtf(_m2[channel] / (_count[channel] - 1)) : 0;
+    }
+
+  private:
+    uint32_t _count[N];
+    float    _mean[N];
+    float    _m2[N];   // Sum of squared differences from the mean
+    int32_t  _min[N];
+    int32_t  _max[N];
+};
@@ -0,0 +1,148 @@
+#pragma once
+
+// Parser for the data line returned by SPEC Sensors DGS-SO2/DGS-NO2 modules.
+// Works in a single pass over a fixed char buffer and doesn't allocate, so it can run every few seconds
+// for months without fragmenting the heap. Has no Arduino dependencies so it can be compiled on the host.
+//
+// The line looks like this (11 comma separated fields, terminated by "\r\n"):
+// SN, PPB, T, RH, ADC_G, ADC_T, ADC_H, DAYS, HOURS, MINUTES, SECONDS
+// 012345678901, 12, 24, 45, 32001, 25320, 29113, 00, 03, 12, 45
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define SPEC_FIELD_COUNT        11
+#define SPEC_SERIAL_NUMBER_SIZE 13 // 12 digits + terminator
+
+struct SpecReading {
+  char     serialNumber[SPEC_SERIAL_NUMBER_SIZE];
+  int32_t  concentrationPPB;
+  int32_t  temperature;        // [°C] As reported by the sensor (no offset applied)
+  int32_t  humidity;           // [%]  As reported by the sensor (no offset applied)
+  int32_t  concentrationADC;
+  int32_t  temperatureDigital;
+  int32_t  humidityDigital;
+  int32_t  uptimeDays;
+  int32_t  uptimeHours;
+  int32_t  uptimeMinutes;
+  int32_t  uptimeSeconds;
+};
+
+enum SpecParseResult : uint8_t {
+  SPEC_PARSE_OK,
+  SPEC_PARSE_FIELD_COUNT,  // Line doesn't have exactly SPEC_FIELD_COUNT fields
+  SPEC_PARSE_BAD_FIELD,    // A field is empty or isn't a number
+  SPEC_PARSE_OUT_OF_RANGE  // A field is a number, but not one the sensor can report
+};
+
+struct SpecFieldRange {
+  int32_t min;
+  int32_t max;
+};
+
+// Valid range of each numeric field, index matches the field position in the line (serial number isn't numeric)
+static const SpecFieldRange specFieldRanges[SPEC_FIELD_COUNT] = {
+  { 0,      0      }, // Serial number, validated separately
+  { -2000,  50000  }, // Concentration [PPB]
+  { -40,    85     }, // Temperature [°C]
+  { 0,      100    }, // Humidity [%]
+  { 0,      65535  }, // Concentration ADC
+  { 0,      65535  }, // Temperature digital
+  { 0,      65535  }, // Humidity digital
+  { 0,      99999  }, // Uptime days
+  { 0,      23     }, // Uptime hours
+  { 0,      59     }, // Uptime minutes
+  { 0,      59     }  // Uptime seconds
+};
+
+inline const char* specParseResultString(SpecParseResult result) {
+  switch (result) {
+    case SPEC_PARSE_OK:           return "OK";
+    case SPEC_PARSE_FIELD_COUNT:  return "Wrong number of fields";
+    case SPEC_PARSE_BAD_FIELD:    return "Empty or non-numeric field";
+    case SPEC_PARSE_OUT_OF_RANGE: return "Value out of range";
+  }
+  return "Unknown";
+}
+
+// Parses a zero-terminated line into 'reading'. 'reading' is only meaningful if SPEC_PARSE_OK is returned.
+inline SpecParseResult specParseLine(const char *line, SpecReading &reading) {
+  int32_t    values[SPEC_FIELD_COUNT];
+  uint8_t    field = 0;
+  const char *p = line;
+
+  while (true) {
+    while (*p == ' ') p++;
+
+    if (field >= SPEC_FIELD_COUNT) {
+      return SPEC_PARSE_FIELD_COUNT;
+    }
+
+    if (field == 0) { // Serial number is kept as text, it doesn't fit in 32 bits
+      uint8_t length = 0;
+      while (*p != '\0' && *p != ',' && *p != ' ' && *p != '\r' && *p != '\n') {
+        if (length < SPEC_SERIAL_NUMBER_SIZE - 1) {
+          reading.serialNumber[length] = *p;
+        }
+        length++;
+        p++;
+      }
+      if (length == 0 || length >= SPEC_SERIAL_NUMBER_SIZE) {
+        return SPEC_PARSE_BAD_FIELD;
+      }
+      reading.serialNumber[length] = '\0';
+    } else {
+      bool    negative = false;
+      uint8_t digits   = 0;
+      int32_t value    = 0;
+      if (*p == '-') {
+        negative = true;
+        p++;
+      }
+      while (*p >= '0' && *p <= '9') {
+        if (digits < 9) { // More digits than this is out of range anyway, don't let the value overflow
+          value = value * 10 + (*p - '0');
+        }
+        digits++;
+        p++;
+      }
+      if (digits == 0) {
+        return SPEC_PARSE_BAD_FIELD;
+      }
+      if (digits > 9) {
+        return SPEC_PARSE_OUT_OF_RANGE;
+      }
+      values[field] = negative ? -value : value;
+      if (values[field] < specFieldRanges[field].min || values[field] > specFieldRanges[field].max) {
+        return SPEC_PARSE_OUT_OF_RANGE;
+      }
+    }
+    field++;
+
+    while (*p == ' ') p++;
+    if (*p == ',') {
+      p++;
+      continue;
+    }
+    if (*p == '\0' || *p == '\r' || *p == '\n') {
+      break;
+    }
+    return SPEC_PARSE_BAD_FIELD; // Garbage right after a value
+  }
+
+  if (field != SPEC_FIELD_COUNT) {
+    return SPEC_PARSE_FIELD_COUNT;
+  }
+
+  reading.concentrationPPB   = values[1];
+  reading.temperature        = values[2];
+  reading.humidity           = values[3];
+  reading.concentrationADC   = values[4];
+  reading.temperatureDigital = values[5];
+  reading.humidityDigital    = values[6];
+  reading.uptimeDays         = values[7];
+  reading.uptimeHours        = values[8];
+  reading.uptimeMinutes      = values[9];
+  reading.uptimeSeconds      = values[10];
+  return SPEC_PARSE_OK;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+// Lock-free single-producer/single-consumer ring buffer.
+// One task may only push() and one other task may only pop(), which lets the sensor task hand samples over to
+// loop() without locks, so neither side ever waits for the other. Has no Arduino dependencies.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+template <typename T, size_t N>
+class SpscRing {
+  static_assert(N >= 2 && (N & (N - 1)) == 0, "SpscRing size must be a power of two");
+
+  public:
+    // Producer side. Returns false (and counts the item as dropped) if the consumer fell behind and the ring is full.
+    bool push(const T &item) {
+      size_t head = _head.load(std::memory_order_relaxed);
+      if (head - _tail.load(std::memory_order_acquire) >= N) {
+        _dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+      }
+      _items[head & (N - 1)] = item;
+      _head.store(head + 1, std::memory_order_release);
+      return true;
+    }
+
+    // Consumer side. Returns false if there's nothing to take.
+    bool pop(T &item) {
+      size_t tail = _tail.load(std::memory_order_relaxed);
+      if (tail == _head.load(std::memory_order_acquire)) {
+        return false;
+      }
+      item = _items[tail & (N - 1)];
+      _tail.store(tail + 1, std::memory_order_release);
+      return true;
+    }
+
+    size_t size() const {
+      return _head.load(std::memory_order_acquire) - _tail.load(std::memory_order_acquire);
+    }
+
+    uint32_t dropped() const {
+      return _dropped.load(std::memory_order_relaxed);
+    }
+
+  private:
+    T                     _items[N];
+    std::atomic<size_t>   _head{0};    // Written only by the producer
+    std::atomic<size_t>   _tail{0};    // Written only by the consumer
+    std::atomic<uint32_t> _dropped{0};
+};
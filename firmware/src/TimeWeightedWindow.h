@@ -0,0 +1,115 @@
+#pragma once
+
+// Time-weighted averages of a fixed set of measurement channels over one window at a time.
+// Every sample holds its value from the moment it was made until the next sample of the same channel, but never longer
+// than the 'maxHold' it was added with, so a missed reading or a stalled sensor leaves a gap instead of stretching the previous value.
+// The held time that falls inside the window is the channel's coverage. A sample that is still held when the window is closed
+// carries over into the next window. All times are in milliseconds (millis()). Has no Arduino dependencies.
+
+#include <stddef.h>
+#include <stdint.h>
+
+template <size_t N>
+class TimeWeightedWindow {
+  public:
+    TimeWeightedWindow() : _start(0), _end(0) {
+      reset(0, N);
+    }
+
+    // Starts a new window, channels that still hold a sample continue with it
+    void begin(uint32_t start, uint32_t end) {
+      _start = start;
+      _end   = end;
+      for (size_t i = 0; i < N; i++) {
+        _sum[i]     = 0;
+        _covered[i] = 0;
+      }
+    }
+
+    // Forgets the held samples of channels first..first+channels-1, e.g. when their sensor goes offline
+    void reset(size_t first, size_t channels) {
+      for (size_t i = first; i < first + channels; i++) {
+        _held[i]    = false;
+        _sum[i]     = 0;
+        _covered[i] = 0;
+      }
+    }
+
+    // Adds one sample made at 'time' to each of the channels first..first+channels-1. 'time' must not be before the previous sample's.
+    // A sample made after the window's end only counts from the next window on, and the one it replaces isn't held past that end,
+    // so close the window before adding it (as processSensorEvents() does).
+    void add(size_t first, uint32_t time, const int32_t *values, size_t channels, uint32_t maxHold) {
+      for (size_t i = first, v = 0; v < channels; i++, v++) {
+        hold(i, time);
+        _held[i]    = true;
+        _value[i]   = values[v];
+        _since[i]   = time;
+        _maxHold[i] = maxHold;
+      }
+    }
+
+    // Accounts for the held samples up to the end of the window, call before reading the results
+    void close() {
+      for (size_t i = 0; i < N; i++) {
+        hold(i, _end);
+      }
+    }
+
+    uint32_t start() const {
+      return _start;
+    }
+
+    uint32_t end() const {
+      return _end;
+    }
+
+    // Milliseconds of the window covered by samples
+    uint32_t covered(size_t channel) const {
+      return _covered[channel];
+    }
+
+    // Percentage of the window covered by samples
+    uint8_t coverage(size_t channel) const {
+      uint32_t length = _end - _start;
+      return length ? (uint8_t)(((uint64_t)_covered[channel] * 100 + length / 2) / length) : 0;
+    }
+
+    // Value * milliseconds of the covered part of the window
+    int64_t sum(size_t channel) const {
+      return _sum[channel];
+    }
+
+    // Only meaningful if covered() > 0
+    float mean(size_t channel) const {
+      return _covered[channel] ? (float)_sum[channel] / _covered[channel] : 0;
+    }
+
+  private:
+    // Accounts for the part of the held sample between the last accounted time and 'until' that's inside the window
+    void hold(size_t i, uint32_t until) {
+      if (!_held[i]) {
+        return;
+      }
+      uint32_t from = _since[i];
+      uint32_t to   = until;
+      if ((int32_t)(from - _start) < 0) from = _start;
+      if ((int32_t)(to - _end) > 0) to = _end;
+      if ((int32_t)(to - (_since[i] + _maxHold[i])) > 0) to = _since[i] + _maxHold[i];
+      if ((int32_t)(to - from) > 0) {
+        _sum[i]     += (int64_t)_value[i] * (to - from);
+        _covered[i] += to - from;
+      }
+      if ((int32_t)(until - _since[i]) >= (int32_t)_maxHold[i]) {
+        _held[i] = false; // Expired, nothing left to carry over
+      }
+    }
+
+    uint32_t _start;
+    uint32_t _end;
+    bool     _held[N];
+    int32_t  _value[N];
+    uint32_t _since[N];   // When the held sample was made
+    uint32_t _maxHold[N];
+    int64_t  _sum[N];     // Value * milliseconds
+    uint32_t _covered[N];
+};
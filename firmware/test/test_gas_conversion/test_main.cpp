@@ -0,0 +1,85 @@
+// GasConversion.h: fixed-point PPB to ug/m3 conversion against a double precision reference, and its speed
+
+#include <unity.h>
+#include <math.h>
+#include <stdio.h>
+#include <time.h>
+#include "../../src/GasConversion.h"
+
+void setUp(void) {}
+void tearDown(void) {}
+
+static const double molarMasses[] = { 64.0638, 46.0055 }; // SO2, NO2
+
+static double referenceTenths(int32_t ppb, double molarMass, int32_t temperature, int32_t pressure) {
+  return ppb * molarMass * pressure / (8.314462618 * (temperature / 10.0 + 273.15)) / 1000.0 * 10.0;
+}
+
+// Whole sensor range: -2000..50000 PPB, -40..85 °C, 30..110 kPa
+void test_conversion_is_within_rounding_of_reference(void) {
+  double worst = 0;
+  for (size_t gas = 0; gas < sizeof molarMasses / sizeof molarMasses[0]; gas++) {
+    int32_t coefficient = gasCoefficient(molarMasses[gas]);
+    for (int32_t ppb = -2000; ppb <= 50000; ppb += 7) {
+      for (int32_t temperature = -400; temperature <= 850; temperature += 25) {
+        for (int32_t pressure = 30000; pressure <= 110000; pressure += 20000) {
+          double error = fabs(gasPpbToUgm3(ppb, coefficient, temperature, pressure) - referenceTenths(ppb, molarMasses[gas], temperature, pressure));
+          if (error > worst) {
+            worst = error;
+          }
+        }
+      }
+    }
+  }
+  char message[64];
+  snprintf(message, sizeof message, "gasPpbToUgm3: worst error %.3f tenths", worst);
+  TEST_MESSAGE(message);
+  TEST_ASSERT_TRUE(worst < 0.51);
+}
+
+void test_reference_conditions(void) {
+  // 1000 PPB of SO2 at 20 °C and 101.325 kPa is 2663.2 ug/m3
+  TEST_ASSERT_EQUAL_INT32(26632, gasPpbToUgm3(1000, gasCoefficient(64.0638), GAS_REFERENCE_TEMPERATURE, GAS_STANDARD_PRESSURE));
+  TEST_ASSERT_EQUAL_INT32(0, gasPpbToUgm3(0, gasCoefficient(64.0638), GAS_REFERENCE_TEMPERATURE, GAS_STANDARD_PRESSURE));
+}
+
+void test_round_tenths(void) {
+  TEST_ASSERT_EQUAL_INT32(3,  gasRoundTenths(25));
+  TEST_ASSERT_EQUAL_INT32(2,  gasRoundTenths(24));
+  TEST_ASSERT_EQUAL_INT32(-3, gasRoundTenths(-25));
+  TEST_ASSERT_EQUAL_INT32(-2, gasRoundTenths(-24));
+  TEST_ASSERT_EQUAL_INT32(0,  gasRoundTenths(4));
+}
+
+void test_temperature_from_digital(void) {
+  for (int32_t digital = 0; digital <= 65535; digital++) {
+    double reference = (-45.0 + 175.0 * digital / 65536.0) * 10.0;
+    TEST_ASSERT_TRUE(fabs(gasTemperatureFromDigital(digital) - reference) <= 0.5);
+  }
+}
+
+void test_benchmark_conversion(void) {
+  const long iterations = 10000000;
+  int32_t    coefficient = gasCoefficient(64.0638);
+  volatile int32_t temperature = 215; // Keeps the compiler from folding the loop
+  int64_t    sum   = 0;
+  clock_t    start = clock();
+  for (long i = 0; i < iterations; i++) {
+    sum += gasPpbToUgm3((int32_t)(i & 0x7FFF), coefficient, temperature, GAS_STANDARD_PRESSURE);
+  }
+  double elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+  char   message[80];
+  snprintf(message, sizeof message, "gasPpbToUgm3: %.2f ns per conversion", elapsed * 1e9 / iterations);
+  TEST_MESSAGE(message);
+  TEST_ASSERT_TRUE(sum > 0);
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_conversion_is_within_rounding_of_reference);
+  RUN_TEST(test_reference_conditions);
+  RUN_TEST(test_round_tenths);
+  RUN_TEST(test_temperature_from_digital);
+  RUN_TEST(test_benchmark_conversion);
+  return UNITY_END();
+}
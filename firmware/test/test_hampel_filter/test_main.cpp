@@ -0,0 +1,124 @@
+// HampelFilter.h: streaming filter against a brute-force (sort every window) reference, and its speed
+
+#include <unity.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <algorithm>
+#include <vector>
+#include "../../src/HampelFilter.h"
+
+void setUp(void) {}
+void tearDown(void) {}
+
+static const size_t Window = 7;
+
+static int64_t referenceMedian(std::vector<int64_t> values) {
+  std::sort(values.begin(), values.end());
+  size_t size = values.size();
+  return size % 2 ? values[size / 2] : (values[size / 2 - 1] + values[size / 2]) / 2;
+}
+
+// Same decision as HampelFilter::filter(), computed by sorting the window and the deviations every time
+static bool referenceFilter(std::vector<int32_t> &window, int32_t &value, uint16_t threshold, int32_t minDeviation) {
+  bool outlier = false;
+  if (threshold && window.size() >= 3) {
+    std::vector<int64_t> samples(window.begin(), window.end());
+    int64_t median = referenceMedian(samples);
+    std::vector<int64_t> deviations;
+    for (size_t i = 0; i < samples.size(); i++) {
+      deviations.push_back(samples[i] > median ? samples[i] - median : median - samples[i]);
+    }
+    int64_t mad       = referenceMedian(deviations);
+    int64_t deviation = value > median ? value - median : median - value;
+    outlier = deviation > minDeviation && deviation * 100000 > (int64_t)threshold * 14826 * mad;
+    window.push_back(value);
+    if (outlier) {
+      value = (int32_t)median;
+    }
+  } else {
+    window.push_back(value);
+  }
+  if (window.size() > Window) {
+    window.erase(window.begin());
+  }
+  return outlier;
+}
+
+void test_matches_reference(void) {
+  HampelFilter<2, Window> filter;
+  std::vector<int32_t>    windows[2];
+  uint32_t                outliers = 0;
+  srand(1);
+  for (int i = 0; i < 200000; i++) {
+    size_t  channel = i % 2;
+    int32_t value   = 1000 + rand() % 200 - 100;
+    if (rand() % 20 == 0) {
+      value += (rand() % 2 ? 1 : -1) * (rand() % 5000); // Spike
+    }
+    if (i % 50000 == 0) {
+      value = 0; // Flat runs
+    }
+    int32_t filtered  = value;
+    int32_t reference = value;
+    bool    outlier   = filter.filter(channel, filtered, 30, 5);
+    TEST_ASSERT_EQUAL(referenceFilter(windows[channel], reference, 30, 5), outlier);
+    TEST_ASSERT_EQUAL_INT32(reference, filtered);
+    outliers += outlier;
+  }
+  TEST_ASSERT_EQUAL_UINT32(outliers, filter.rejected(0) + filter.rejected(1));
+  TEST_ASSERT_GREATER_THAN(0, outliers);
+}
+
+void test_flat_signal_respects_min_deviation(void) {
+  HampelFilter<1, Window> filter;
+  for (int i = 0; i < 10; i++) {
+    int32_t value = 500;
+    TEST_ASSERT_FALSE(filter.filter(0, value, 30, 10));
+  }
+  int32_t step = 505; // MAD is 0, but the step isn't larger than minDeviation
+  TEST_ASSERT_FALSE(filter.filter(0, step, 30, 10));
+  int32_t spike = 600;
+  TEST_ASSERT_TRUE(filter.filter(0, spike, 30, 10));
+  TEST_ASSERT_EQUAL_INT32(500, spike);
+}
+
+void test_disabled_channel_passes_everything(void) {
+  HampelFilter<1, Window> filter;
+  for (int i = 0; i < 10; i++) {
+    int32_t value = i % 2 ? 100000 : 0;
+    TEST_ASSERT_FALSE(filter.filter(0, value, 0, 0));
+  }
+  TEST_ASSERT_EQUAL_UINT32(0, filter.rejected(0));
+}
+
+void test_benchmark_filter(void) {
+  const long              iterations = 10000000;
+  static HampelFilter<1, Window> filter;
+  std::vector<int32_t>    samples(4096);
+  srand(2);
+  for (size_t i = 0; i < samples.size(); i++) {
+    samples[i] = 1000 + rand() % 200 - 100 + (rand() % 20 == 0 ? 3000 : 0);
+  }
+  int64_t sum   = 0;
+  clock_t start = clock();
+  for (long i = 0; i < iterations; i++) {
+    int32_t value = samples[i & 4095];
+    filter.filter(0, value, 30, 5);
+    sum += value;
+  }
+  double elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+  char   message[80];
+  snprintf(message, sizeof message, "HampelFilter<1, %u>: %.1f ns per sample", (unsigned)Window, elapsed * 1e9 / iterations);
+  TEST_MESSAGE(message);
+  TEST_ASSERT_TRUE(sum > 0);
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_matches_reference);
+  RUN_TEST(test_flat_signal_respects_min_deviation);
+  RUN_TEST(test_disabled_channel_passes_everything);
+  RUN_TEST(test_benchmark_filter);
+  return UNITY_END();
+}
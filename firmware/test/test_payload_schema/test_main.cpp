@@ -0,0 +1,78 @@
+// PayloadSchema.h: every compact key maps back to its long name, and keys outside the tables pass through unchanged
+
+#include <unity.h>
+#include <stdio.h>
+#include "../../src/PayloadSchema.h"
+
+void setUp(void) {}
+void tearDown(void) {}
+
+static const size_t prefixCount = sizeof payloadPrefixes / sizeof payloadPrefixes[0];
+static const size_t keyCount    = sizeof payloadKeys / sizeof payloadKeys[0];
+
+static void assertRoundTrip(const char* name) {
+  char        compactBuffer[32], longBuffer[64];
+  const char* compact = payloadCompactKey(name, compactBuffer, sizeof compactBuffer);
+  TEST_ASSERT_EQUAL_STRING_MESSAGE(name, payloadLongKey(compact, longBuffer, sizeof longBuffer), name);
+}
+
+void test_short_keys_are_unique(void) {
+  for (size_t i = 0; i < keyCount; i++) {
+    TEST_ASSERT_NULL(strchr(payloadKeys[i].key, '_')); // Would be taken for a composed key
+    for (size_t j = i + 1; j < keyCount; j++) {
+      TEST_ASSERT_TRUE_MESSAGE(strcmp(payloadKeys[i].key, payloadKeys[j].key) != 0, payloadKeys[j].name);
+      TEST_ASSERT_TRUE_MESSAGE(strcmp(payloadKeys[i].name, payloadKeys[j].name) != 0, payloadKeys[j].name);
+    }
+  }
+  for (size_t i = 0; i < prefixCount; i++) {
+    for (size_t j = i + 1; j < prefixCount; j++) {
+      TEST_ASSERT_TRUE(strcmp(payloadPrefixes[i].key, payloadPrefixes[j].key) != 0);
+    }
+  }
+}
+
+void test_every_key_round_trips(void) {
+  for (size_t i = 0; i < keyCount; i++) {
+    assertRoundTrip(payloadKeys[i].name);
+  }
+}
+
+void test_every_composed_key_round_trips(void) {
+  char name[64];
+  for (size_t prefix = 0; prefix < prefixCount; prefix++) {
+    for (size_t i = 0; i < keyCount; i++) {
+      snprintf(name, sizeof name, "%s_%s", payloadPrefixes[prefix].name, payloadKeys[i].name);
+      assertRoundTrip(name);
+    }
+  }
+}
+
+void test_composed_key_example(void) {
+  char buffer[16];
+  TEST_ASSERT_EQUAL_STRING("s_urb", payloadCompactKey("so2_uart_rx_bytes", buffer, sizeof buffer));
+  TEST_ASSERT_EQUAL_STRING("d_rssi", payloadCompactKey("device_wifi_rssi", buffer, sizeof buffer));
+}
+
+void test_other_keys_pass_through(void) {
+  // Keys the firmware publishes that aren't in the tables
+  const char* names[] = {
+    "v", "SO2", "NO2", "PM1", "PM2_5", "PM10", "aqi", "sampled_at", "delta", "command", "status", "duration",
+    "so2_1h", "PM2_5_24h", "temperature_min", "humidity_sd", "SO2_n", "device_active_time", "device_mqtt_connect_time",
+    "device_sensor_events_dropped", "device_last_command_latency"
+  };
+  char buffer[32];
+  for (size_t i = 0; i < sizeof names / sizeof names[0]; i++) {
+    assertRoundTrip(names[i]);
+    TEST_ASSERT_EQUAL_STRING(names[i], payloadLongKey(names[i], buffer, sizeof buffer));
+  }
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_short_keys_are_unique);
+  RUN_TEST(test_every_key_round_trips);
+  RUN_TEST(test_every_composed_key_round_trips);
+  RUN_TEST(test_composed_key_example);
+  RUN_TEST(test_other_keys_pass_through);
+  return UNITY_END();
+}
@@ -0,0 +1,170 @@
+// RecordRing.h: store-and-forward ring on in-memory flash (bits only go 1 -> 0 until a sector is erased)
+
+#include <unity.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../src/RecordRing.h"
+
+void setUp(void) {}
+void tearDown(void) {}
+
+static const size_t Sectors = 4;
+
+struct MemoryStorage {
+  uint8_t bytes[Sectors * RECORD_RING_SECTOR_SIZE];
+
+  MemoryStorage() {
+    memset(bytes, 0xFF, sizeof bytes);
+  }
+  bool read(uint32_t address, void* data, size_t size) {
+    memcpy(data, bytes + address, size);
+    return true;
+  }
+  bool write(uint32_t address, const void* data, size_t size) {
+    for (size_t i = 0; i < size; i++) {
+      bytes[address + i] &= ((const uint8_t*)data)[i];
+    }
+    return true;
+  }
+  bool erase(uint32_t address, size_t size) {
+    memset(bytes + address, 0xFF, size);
+    return true;
+  }
+};
+
+struct TestRecord {
+  static const uint8_t layout = 2;
+  static size_t layoutSize(uint8_t layout) {
+    return layout == 1 ? offsetof(TestRecord, added) : layout == 2 ? sizeof(TestRecord) : 0;
+  }
+
+  uint32_t id;
+  uint8_t  payload[20];
+  uint32_t added;       // Not in layout 1
+};
+
+static TestRecord makeRecord(uint32_t id) {
+  TestRecord record;
+  record.id    = id;
+  memset(record.payload, (uint8_t)id, sizeof record.payload);
+  record.added = id;
+  return record;
+}
+
+void test_records_come_back_in_order_after_a_reboot(void) {
+  static MemoryStorage storage;
+  {
+    RecordRing<MemoryStorage, TestRecord> ring(storage);
+    TEST_ASSERT_TRUE(ring.begin(Sectors));
+    for (uint32_t id = 0; id < 10; id++) {
+      TEST_ASSERT_TRUE(ring.push(makeRecord(id)));
+    }
+    TestRecord record;
+    TEST_ASSERT_TRUE(ring.peek(record));
+    ring.pop();
+  }
+  RecordRing<MemoryStorage, TestRecord> ring(storage);
+  TEST_ASSERT_TRUE(ring.begin(Sectors));
+  TEST_ASSERT_EQUAL_UINT32(9, ring.pending());
+  for (uint32_t id = 1; id < 10; id++) {
+    TestRecord record;
+    TEST_ASSERT_TRUE(ring.peek(record));
+    TEST_ASSERT_EQUAL_UINT32(id, record.id);
+    ring.pop();
+  }
+  TEST_ASSERT_EQUAL_UINT32(0, ring.pending());
+}
+
+void test_full_ring_drops_the_oldest_sector(void) {
+  static MemoryStorage storage;
+  RecordRing<MemoryStorage, TestRecord> ring(storage);
+  ring.begin(Sectors);
+  uint32_t count = ring.capacity() + 1;
+  for (uint32_t id = 0; id < count; id++) {
+    ring.push(makeRecord(id));
+  }
+  uint32_t slotsPerSector = RECORD_RING_SECTOR_SIZE / RECORD_RING_SLOT_SIZE;
+  TEST_ASSERT_EQUAL_UINT32(slotsPerSector, ring.dropped());
+  TestRecord record;
+  TEST_ASSERT_TRUE(ring.peek(record));
+  TEST_ASSERT_EQUAL_UINT32(slotsPerSector, record.id);
+}
+
+void test_leftover_data_is_erased(void) {
+  static MemoryStorage storage;
+  srand(3);
+  for (size_t i = 0; i < sizeof storage.bytes; i++) { // E.g. a file system left in the partition
+    storage.bytes[i] = rand() % 256;
+  }
+  RecordRing<MemoryStorage, TestRecord> ring(storage);
+  TEST_ASSERT_FALSE(ring.begin(Sectors));
+  TEST_ASSERT_EQUAL_UINT32(0, ring.pending());
+  for (size_t i = 0; i < sizeof storage.bytes; i++) {
+    TEST_ASSERT_EQUAL(0xFF, storage.bytes[i]);
+  }
+  TEST_ASSERT_TRUE(ring.push(makeRecord(7)));
+  TestRecord record;
+  TEST_ASSERT_TRUE(ring.peek(record));
+  TEST_ASSERT_EQUAL_UINT32(7, record.id);
+}
+
+void test_corrupt_record_is_dropped(void) {
+  static MemoryStorage storage;
+  RecordRing<MemoryStorage, TestRecord> ring(storage);
+  ring.begin(Sectors);
+  ring.push(makeRecord(1));
+  ring.push(makeRecord(2));
+  storage.bytes[8 + 5] = 0; // Payload of the first record (after the 8 byte slot header and its id)
+  TestRecord record;
+  TEST_ASSERT_TRUE(ring.peek(record));
+  TEST_ASSERT_EQUAL_UINT32(2, record.id);
+  TEST_ASSERT_EQUAL_UINT32(1, ring.dropped());
+}
+
+static uint16_t crc16(const uint8_t *bytes, size_t size) { // CRC-16/CCITT-FALSE
+  uint16_t value = 0xFFFF;
+  for (size_t i = 0; i < size; i++) {
+    value ^= (uint16_t)bytes[i] << 8;
+    for (int bit = 0; bit < 8; bit++) {
+      value = value & 0x8000 ? (value << 1) ^ 0x1021 : value << 1;
+    }
+  }
+  return value;
+}
+
+void test_records_of_an_older_layout_are_read(void) {
+  static MemoryStorage storage;
+  // Slot as written before layouts were kept: layout byte left erased, CRC over the layout 1 size only
+  TestRecord old = makeRecord(5);
+  uint8_t    crcInput[4 + offsetof(TestRecord, added)];
+  uint32_t   sequence = 0;
+  memcpy(crcInput, &sequence, 4);
+  memcpy(crcInput + 4, &old, offsetof(TestRecord, added));
+  uint16_t   crc = crc16(crcInput, sizeof crcInput);
+  uint8_t    header[8] = { 0, 0, 0, 0, 0xFE, 0xFF, (uint8_t)crc, (uint8_t)(crc >> 8) };
+  storage.write(0, header, sizeof header);
+  storage.write(sizeof header, &old, offsetof(TestRecord, added));
+
+  RecordRing<MemoryStorage, TestRecord> ring(storage);
+  TEST_ASSERT_TRUE(ring.begin(Sectors));
+  TEST_ASSERT_EQUAL_UINT32(1, ring.pending());
+  TestRecord record;
+  TEST_ASSERT_TRUE(ring.peek(record));
+  TEST_ASSERT_EQUAL_UINT32(5, record.id);
+  TEST_ASSERT_EQUAL(5, record.payload[19]);
+  TEST_ASSERT_EQUAL_UINT32(0, record.added);
+  ring.pop();
+  TEST_ASSERT_TRUE(ring.push(makeRecord(6))); // Written with the current layout after it
+  TEST_ASSERT_TRUE(ring.peek(record));
+  TEST_ASSERT_EQUAL_UINT32(6, record.added);
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_records_come_back_in_order_after_a_reboot);
+  RUN_TEST(test_full_ring_drops_the_oldest_sector);
+  RUN_TEST(test_leftover_data_is_erased);
+  RUN_TEST(test_corrupt_record_is_dropped);
+  RUN_TEST(test_records_of_an_older_layout_are_read);
+  return UNITY_END();
+}
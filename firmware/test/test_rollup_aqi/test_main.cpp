@@ -0,0 +1,123 @@
+// SensorRollup.h: carry-over from minutes to quarters, hours and the 24 hour running total
+// AirQualityIndex.h: the EEA band boundaries of every pollutant
+
+#include <unity.h>
+#include "../../src/SensorRollup.h"
+#include "../../src/AirQualityIndex.h"
+
+void setUp(void) {}
+void tearDown(void) {}
+
+static const uint32_t Day = 24 * 60;
+static const uint32_t Base = 28000000 / Day * Day; // Minutes since epoch at midnight, so quarters and hours start on multiples
+
+static void addMinute(SensorRollup<1> &rollup, uint32_t minute, int32_t value, uint32_t covered = 60000) {
+  int64_t sum = (int64_t)value * covered;
+  rollup.addMinute(minute, &sum, &covered);
+}
+
+void test_minutes_roll_up_into_a_quarter(void) {
+  SensorRollup<1> rollup;
+  for (uint32_t i = 0; i < 14; i++) {
+    addMinute(rollup, Base + i, i < 5 ? 10 : 40);
+  }
+  TEST_ASSERT_EQUAL_UINT32(0, rollup.covered(ROLLUP_15M, 0)); // Not complete yet
+  addMinute(rollup, Base + 14, 40);
+  TEST_ASSERT_EQUAL_UINT32(900000, rollup.covered(ROLLUP_15M, 0));
+  TEST_ASSERT_EQUAL_INT(100, rollup.coverage(ROLLUP_15M, 0));
+  TEST_ASSERT_EQUAL_FLOAT(30, rollup.mean(ROLLUP_15M, 0)); // 5 minutes of 10, 10 of 40
+  TEST_ASSERT_EQUAL_FLOAT(40, rollup.mean(ROLLUP_1M, 0));
+}
+
+void test_quarters_roll_up_into_an_hour_with_a_gap(void) {
+  SensorRollup<1> rollup;
+  for (uint32_t i = 0; i < 60; i++) {
+    if (i >= 15 && i < 30) {
+      continue; // Second quarter missing, skipped minutes count as not covered
+    }
+    addMinute(rollup, Base + i, i < 15 ? 20 : 60);
+  }
+  TEST_ASSERT_EQUAL_UINT32(2700000, rollup.covered(ROLLUP_1H, 0));
+  TEST_ASSERT_EQUAL_INT(75, rollup.coverage(ROLLUP_1H, 0));
+  TEST_ASSERT_EQUAL_FLOAT((20 + 60 + 60) / 3.0f, rollup.mean(ROLLUP_1H, 0));
+}
+
+void test_24_hour_total_drops_the_oldest_hour(void) {
+  SensorRollup<1> rollup;
+  for (uint32_t i = 0; i < Day; i++) {
+    addMinute(rollup, Base + i, i < 60 ? 240 : 0); // 240 in the first hour, 0 in the other 23
+  }
+  TEST_ASSERT_EQUAL_UINT32(86400000, rollup.covered(ROLLUP_24H, 0));
+  TEST_ASSERT_EQUAL_FLOAT(10, rollup.mean(ROLLUP_24H, 0));
+  for (uint32_t i = Day; i < Day + 60; i++) { // 25th hour replaces the first one
+    addMinute(rollup, Base + i, 0);
+  }
+  TEST_ASSERT_EQUAL_UINT32(86400000, rollup.covered(ROLLUP_24H, 0));
+  TEST_ASSERT_EQUAL_FLOAT(0, rollup.mean(ROLLUP_24H, 0));
+}
+
+void test_partial_minutes_are_weighted_by_coverage(void) {
+  SensorRollup<1> rollup;
+  for (uint32_t i = 0; i < 15; i++) {
+    addMinute(rollup, Base + i, i == 0 ? 100 : 10, i == 0 ? 30000 : 60000);
+  }
+  TEST_ASSERT_EQUAL_UINT32(870000, rollup.covered(ROLLUP_15M, 0));
+  TEST_ASSERT_EQUAL_INT(97, rollup.coverage(ROLLUP_15M, 0));
+  TEST_ASSERT_FLOAT_WITHIN(1e-3, (100.0f * 30 + 10.0f * 840) / 870, rollup.mean(ROLLUP_15M, 0));
+}
+
+void test_old_minutes_and_long_gaps(void) {
+  SensorRollup<1> rollup;
+  for (uint32_t i = 0; i < 60; i++) {
+    addMinute(rollup, Base + i, 50);
+  }
+  addMinute(rollup, Base + 30, 1000); // Already past, ignored
+  TEST_ASSERT_EQUAL_FLOAT(50, rollup.mean(ROLLUP_1H, 0));
+  TEST_ASSERT_EQUAL_FLOAT(50, rollup.mean(ROLLUP_1M, 0));
+  addMinute(rollup, Base + 2 * Day + 10, 70); // More than 24 hours later, nothing of before is left
+  TEST_ASSERT_EQUAL_UINT32(0, rollup.covered(ROLLUP_24H, 0));
+  TEST_ASSERT_EQUAL_UINT32(0, rollup.covered(ROLLUP_1H, 0));
+  TEST_ASSERT_EQUAL_FLOAT(70, rollup.mean(ROLLUP_1M, 0));
+}
+
+void test_aqi_band_boundaries(void) {
+  for (uint8_t pollutant = 0; pollutant < AQI_POLLUTANT_COUNT; pollutant++) {
+    TEST_ASSERT_EQUAL_INT(1, aqiLevel((AqiPollutant)pollutant, 0));
+    for (uint8_t level = 1; level <= 5; level++) {
+      float bound = aqiBands[pollutant][level - 1];
+      TEST_ASSERT_EQUAL_INT(level, aqiLevel((AqiPollutant)pollutant, bound)); // Upper bound is still inside the band
+      TEST_ASSERT_EQUAL_INT(level + 1, aqiLevel((AqiPollutant)pollutant, bound + 0.1f));
+    }
+    TEST_ASSERT_EQUAL_INT(6, aqiLevel((AqiPollutant)pollutant, 100000));
+  }
+}
+
+void test_aqi_bands_match_eea(void) {
+  const float expected[AQI_POLLUTANT_COUNT][5] = { // Upper bounds of the EEA index levels 1-5, in µg/m³
+    { 10,  20,  25,  50,  75  },
+    { 20,  40,  50,  100, 150 },
+    { 40,  90,  120, 230, 340 },
+    { 100, 200, 350, 500, 750 },
+  };
+  for (uint8_t pollutant = 0; pollutant < AQI_POLLUTANT_COUNT; pollutant++) {
+    for (uint8_t band = 0; band < 5; band++) {
+      TEST_ASSERT_EQUAL_FLOAT(expected[pollutant][band], aqiBands[pollutant][band]);
+    }
+  }
+  TEST_ASSERT_EQUAL_INT(3, aqiLevel(AQI_PM2_5, 22.4f));
+  TEST_ASSERT_EQUAL_INT(4, aqiLevel(AQI_PM10, 73));
+  TEST_ASSERT_EQUAL_INT(2, aqiLevel(AQI_NO2, 41));
+  TEST_ASSERT_EQUAL_INT(5, aqiLevel(AQI_SO2, 600));
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_minutes_roll_up_into_a_quarter);
+  RUN_TEST(test_quarters_roll_up_into_an_hour_with_a_gap);
+  RUN_TEST(test_24_hour_total_drops_the_oldest_hour);
+  RUN_TEST(test_partial_minutes_are_weighted_by_coverage);
+  RUN_TEST(test_old_minutes_and_long_gaps);
+  RUN_TEST(test_aqi_band_boundaries);
+  RUN_TEST(test_aqi_bands_match_eea);
+  return UNITY_END();
+}
@@ -0,0 +1,48 @@
+// SensorRecovery.h: backoff schedule and offline time, including outages across a millis() wrap
+
+#include <unity.h>
+#include "../../src/SensorRecovery.h"
+
+void setUp(void) {}
+void tearDown(void) {}
+
+static const uint32_t minDelay = 60000, maxDelay = 1800000;
+
+void test_delay_doubles_up_to_the_maximum(void) {
+  SensorRecovery recovery = sensorRecoveryMake(minDelay, maxDelay);
+  uint32_t       now      = 0;
+  for (int i = 0; i < 10; i++) {
+    sensorRecoveryFailed(recovery, now, 0);
+    now = recovery.nextAttempt;
+  }
+  TEST_ASSERT_EQUAL_UINT32(maxDelay, recovery.delay);
+  TEST_ASSERT_TRUE(sensorRecoveryDue(recovery, now));
+  TEST_ASSERT_FALSE(sensorRecoveryDue(recovery, now - 1));
+}
+
+void test_offline_time_survives_millis_wrap(void) {
+  SensorRecovery recovery = sensorRecoveryMake(minDelay, maxDelay);
+  uint32_t       now      = 0xFFFFFFFFu - 3600000; // An hour before millis() wraps
+  sensorRecoveryStart(recovery, now);
+  sensorRecoveryFailed(recovery, now, 0);
+  const uint64_t outage = 60ULL * 24 * 3600 * 1000; // 60 days, longer than a whole millis() period
+  uint64_t       elapsed  = 0;
+  while (elapsed < outage) {
+    elapsed += recovery.delay;
+    now     += recovery.delay;
+    sensorRecoveryAttempted(recovery);
+    sensorRecoveryFailed(recovery, now, 0);
+  }
+  uint32_t seconds = sensorRecoveryOfflineSeconds(recovery, now);
+  TEST_ASSERT_EQUAL_UINT32(elapsed / 1000, seconds);
+  sensorRecoverySucceeded(recovery, now + 1000);
+  TEST_ASSERT_EQUAL_UINT32(seconds + 1, sensorRecoveryOfflineSeconds(recovery, now + 5000)); // Online again, no longer growing
+  TEST_ASSERT_EQUAL_UINT32(1, recovery.successes);
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_delay_doubles_up_to_the_maximum);
+  RUN_TEST(test_offline_time_survives_millis_wrap);
+  return UNITY_END();
+}
@@ -0,0 +1,100 @@
+// SensorStats.h: Welford mean and standard deviation against a two-pass reference, min/max and reset
+
+#include <unity.h>
+#include <math.h>
+#include <stdlib.h>
+#include <vector>
+#include "../../src/SensorStats.h"
+
+void setUp(void) {}
+void tearDown(void) {}
+
+static const size_t Channels = 3;
+
+// Mean, then the sum of squared differences from it, in double
+static void reference(const std::vector<int32_t> &values, double &mean, double &stddev) {
+  double sum = 0;
+  for (size_t i = 0; i < values.size(); i++) {
+    sum += values[i];
+  }
+  mean = sum / values.size();
+  double squares = 0;
+  for (size_t i = 0; i < values.size(); i++) {
+    squares += (values[i] - mean) * (values[i] - mean);
+  }
+  stddev = values.size() > 1 ? sqrt(squares / (values.size() - 1)) : 0;
+}
+
+void test_matches_two_pass_reference(void) {
+  SensorStats<Channels> stats;
+  std::vector<int32_t>  values[Channels];
+  const int32_t         offsets[Channels] = { 20000, -500, 45 }; // A large offset is where a naive sum of squares loses precision
+  const int32_t         spreads[Channels] = { 300, 2000, 1 };
+  srand(1);
+  for (int sample = 0; sample < 1000; sample++) {
+    int32_t row[Channels];
+    for (size_t c = 0; c < Channels; c++) {
+      row[c] = offsets[c] + rand() % (2 * spreads[c] + 1) - spreads[c];
+      values[c].push_back(row[c]);
+    }
+    stats.add(0, row, Channels);
+  }
+  for (size_t c = 0; c < Channels; c++) {
+    double mean, stddev;
+    reference(values[c], mean, stddev);
+    TEST_ASSERT_EQUAL_UINT32(1000, stats.count(c));
+    TEST_ASSERT_FLOAT_WITHIN(fabs(mean) * 1e-5 + 1e-3, mean, stats.mean(c));
+    TEST_ASSERT_FLOAT_WITHIN(stddev * 1e-3 + 1e-3, stddev, stats.stddev(c));
+    TEST_ASSERT_EQUAL_INT32((int32_t)lround(mean), stats.roundedMean(c));
+  }
+}
+
+void test_min_max(void) {
+  SensorStats<2> stats;
+  const int32_t  rows[][2] = { { 5, -5 }, { -7, 12 }, { 3, 0 } };
+  for (size_t i = 0; i < 3; i++) {
+    stats.add(0, rows[i], 2);
+  }
+  TEST_ASSERT_EQUAL_INT32(-7, stats.minimum(0));
+  TEST_ASSERT_EQUAL_INT32(5, stats.maximum(0));
+  TEST_ASSERT_EQUAL_INT32(-5, stats.minimum(1));
+  TEST_ASSERT_EQUAL_INT32(12, stats.maximum(1));
+}
+
+void test_single_sample(void) {
+  SensorStats<1> stats;
+  const int32_t  value = 42;
+  stats.add(0, &value, 1);
+  TEST_ASSERT_EQUAL_FLOAT(42, stats.mean(0));
+  TEST_ASSERT_EQUAL_FLOAT(0, stats.stddev(0)); // Needs two samples
+  TEST_ASSERT_EQUAL_INT32(42, stats.minimum(0));
+  TEST_ASSERT_EQUAL_INT32(42, stats.maximum(0));
+}
+
+void test_reset_only_touches_its_channels(void) {
+  SensorStats<Channels> stats;
+  const int32_t         row[Channels] = { 10, 20, 30 };
+  stats.add(0, row, Channels);
+  stats.add(1, row, 2); // Channels 1 and 2 get another sample (10, 20)
+  stats.reset(1, 2);
+  TEST_ASSERT_EQUAL_UINT32(1, stats.count(0));
+  TEST_ASSERT_EQUAL_FLOAT(10, stats.mean(0));
+  TEST_ASSERT_EQUAL_UINT32(0, stats.count(1));
+  TEST_ASSERT_EQUAL_UINT32(0, stats.count(2));
+  stats.add(1, row + 1, 1); // Starts over, nothing left of the earlier samples
+  TEST_ASSERT_EQUAL_FLOAT(20, stats.mean(1));
+  TEST_ASSERT_EQUAL_INT32(20, stats.minimum(1));
+  TEST_ASSERT_EQUAL_INT32(20, stats.maximum(1));
+  TEST_ASSERT_EQUAL_FLOAT(0, stats.stddev(1));
+  stats.reset();
+  TEST_ASSERT_EQUAL_UINT32(0, stats.count(0));
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_matches_two_pass_reference);
+  RUN_TEST(test_min_max);
+  RUN_TEST(test_single_sample);
+  RUN_TEST(test_reset_only_touches_its_channels);
+  return UNITY_END();
+}
@@ -0,0 +1,82 @@
+// SpecReading.h: parsing of DGS-SO2/DGS-NO2 data lines and a parse microbenchmark
+
+#include <unity.h>
+#include <stdio.h>
+#include <time.h>
+#include "../../src/SpecReading.h"
+
+void setUp(void) {}
+void tearDown(void) {}
+
+static const char* validLine = "012345678901, 12, 24, 45, 32001, 25320, 29113, 00, 03, 12, 45\r\n";
+
+void test_parses_every_field(void) {
+  SpecReading reading;
+  TEST_ASSERT_EQUAL(SPEC_PARSE_OK, specParseLine(validLine, reading));
+  TEST_ASSERT_EQUAL_STRING("012345678901", reading.serialNumber);
+  TEST_ASSERT_EQUAL_INT32(12,    reading.concentrationPPB);
+  TEST_ASSERT_EQUAL_INT32(24,    reading.temperature);
+  TEST_ASSERT_EQUAL_INT32(45,    reading.humidity);
+  TEST_ASSERT_EQUAL_INT32(32001, reading.concentrationADC);
+  TEST_ASSERT_EQUAL_INT32(25320, reading.temperatureDigital);
+  TEST_ASSERT_EQUAL_INT32(29113, reading.humidityDigital);
+  TEST_ASSERT_EQUAL_INT32(0,     reading.uptimeDays);
+  TEST_ASSERT_EQUAL_INT32(3,     reading.uptimeHours);
+  TEST_ASSERT_EQUAL_INT32(12,    reading.uptimeMinutes);
+  TEST_ASSERT_EQUAL_INT32(45,    reading.uptimeSeconds);
+}
+
+void test_accepts_negative_values_and_no_line_ending(void) {
+  SpecReading reading;
+  TEST_ASSERT_EQUAL(SPEC_PARSE_OK, specParseLine("012345678901,-15,-3,45,32001,25320,29113,00,03,12,45", reading));
+  TEST_ASSERT_EQUAL_INT32(-15, reading.concentrationPPB);
+  TEST_ASSERT_EQUAL_INT32(-3,  reading.temperature);
+}
+
+void test_rejects_wrong_field_count(void) {
+  SpecReading reading;
+  TEST_ASSERT_EQUAL(SPEC_PARSE_FIELD_COUNT, specParseLine("012345678901, 12, 24, 45, 32001, 25320, 29113, 00, 03, 12\r\n", reading));
+  TEST_ASSERT_EQUAL(SPEC_PARSE_FIELD_COUNT, specParseLine("012345678901, 12, 24, 45, 32001, 25320, 29113, 00, 03, 12, 45, 1\r\n", reading));
+}
+
+void test_rejects_empty_or_non_numeric_fields(void) {
+  SpecReading reading;
+  TEST_ASSERT_EQUAL(SPEC_PARSE_BAD_FIELD, specParseLine("", reading));
+  TEST_ASSERT_EQUAL(SPEC_PARSE_BAD_FIELD, specParseLine("012345678901, , 24, 45, 32001, 25320, 29113, 00, 03, 12, 45\r\n", reading));
+  TEST_ASSERT_EQUAL(SPEC_PARSE_BAD_FIELD, specParseLine("012345678901, 12x, 24, 45, 32001, 25320, 29113, 00, 03, 12, 45\r\n", reading));
+  TEST_ASSERT_EQUAL(SPEC_PARSE_BAD_FIELD, specParseLine("0123456789012, 12, 24, 45, 32001, 25320, 29113, 00, 03, 12, 45\r\n", reading)); // Serial number too long
+}
+
+void test_rejects_out_of_range_values(void) {
+  SpecReading reading;
+  TEST_ASSERT_EQUAL(SPEC_PARSE_OUT_OF_RANGE, specParseLine("012345678901, 12, 24, 101, 32001, 25320, 29113, 00, 03, 12, 45\r\n", reading));
+  TEST_ASSERT_EQUAL(SPEC_PARSE_OUT_OF_RANGE, specParseLine("012345678901, 12, 24, 45, 32001, 25320, 29113, 00, 24, 12, 45\r\n", reading));
+  TEST_ASSERT_EQUAL(SPEC_PARSE_OUT_OF_RANGE, specParseLine("012345678901, 12345678901, 24, 45, 32001, 25320, 29113, 00, 03, 12, 45\r\n", reading));
+}
+
+void test_benchmark_parse(void) {
+  const long iterations = 1000000;
+  SpecReading reading;
+  int32_t     sum   = 0;
+  clock_t     start = clock();
+  for (long i = 0; i < iterations; i++) {
+    specParseLine(validLine, reading);
+    sum += reading.concentrationPPB;
+  }
+  double elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+  char   message[80];
+  snprintf(message, sizeof message, "specParseLine: %.1f ns per line", elapsed * 1e9 / iterations);
+  TEST_MESSAGE(message);
+  TEST_ASSERT_EQUAL_INT32(12 * iterations, sum);
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_parses_every_field);
+  RUN_TEST(test_accepts_negative_values_and_no_line_ending);
+  RUN_TEST(test_rejects_wrong_field_count);
+  RUN_TEST(test_rejects_empty_or_non_numeric_fields);
+  RUN_TEST(test_rejects_out_of_range_values);
+  RUN_TEST(test_benchmark_parse);
+  return UNITY_END();
+}
@@ -0,0 +1,103 @@
+// TimeWeightedWindow.h: weighting by hold time, the maxHold cap, gaps, carry-over between windows and coverage
+
+#include <unity.h>
+#include "../../src/TimeWeightedWindow.h"
+
+void setUp(void) {}
+void tearDown(void) {}
+
+static void add(TimeWeightedWindow<1> &window, uint32_t time, int32_t value, uint32_t maxHold) {
+  window.add(0, time, &value, 1, maxHold);
+}
+
+void test_weighted_by_hold_time(void) {
+  TimeWeightedWindow<1> window;
+  window.begin(0, 4000);
+  add(window, 0, 0, 10000);
+  add(window, 3000, 100, 10000); // Held for 1000 ms against 3000 ms of 0, a plain average would be 50
+  window.close();
+  TEST_ASSERT_EQUAL_UINT32(4000, window.covered(0));
+  TEST_ASSERT_EQUAL_INT(100, window.coverage(0));
+  TEST_ASSERT_EQUAL_FLOAT(25, window.mean(0));
+}
+
+void test_gap_is_not_filled(void) {
+  TimeWeightedWindow<1> window;
+  window.begin(0, 10000);
+  add(window, 0, 10, 2000);
+  add(window, 1000, 20, 2000); // Held until 3000 only (maxHold), then nothing until 6000
+  add(window, 6000, 30, 2000); // Held until 8000
+  window.close();
+  TEST_ASSERT_EQUAL_UINT32(5000, window.covered(0));
+  TEST_ASSERT_EQUAL_INT(50, window.coverage(0));
+  TEST_ASSERT_EQUAL_INT64(10 * 1000 + 20 * 2000 + 30 * 2000, window.sum(0));
+  TEST_ASSERT_EQUAL_FLOAT(22, window.mean(0));
+}
+
+void test_held_sample_carries_over(void) {
+  TimeWeightedWindow<1> window;
+  window.begin(0, 1000);
+  add(window, 800, 50, 500); // Held until 1300, 200 ms of it in this window
+  window.close();
+  TEST_ASSERT_EQUAL_UINT32(200, window.covered(0));
+  TEST_ASSERT_EQUAL_INT(20, window.coverage(0));
+  window.begin(1000, 2000);
+  window.close();
+  TEST_ASSERT_EQUAL_UINT32(300, window.covered(0));
+  TEST_ASSERT_EQUAL_FLOAT(50, window.mean(0));
+  window.begin(2000, 3000); // Expired, nothing left
+  window.close();
+  TEST_ASSERT_EQUAL_UINT32(0, window.covered(0));
+  TEST_ASSERT_EQUAL_INT(0, window.coverage(0));
+}
+
+void test_sample_past_window_end(void) {
+  TimeWeightedWindow<1> window;
+  window.begin(0, 1000);
+  add(window, 0, 10, 5000);
+  add(window, 1200, 40, 5000); // Made after the window ended, none of it counts here
+  window.close();
+  TEST_ASSERT_EQUAL_UINT32(1000, window.covered(0));
+  TEST_ASSERT_EQUAL_FLOAT(10, window.mean(0));
+  // It's held from the time it was made in the next window. processSensorEvents() closes the window before
+  // handling such a sample, so the previous one also covers 1000-1200 there.
+  window.begin(1000, 2000);
+  window.close();
+  TEST_ASSERT_EQUAL_UINT32(800, window.covered(0));
+  TEST_ASSERT_EQUAL_FLOAT(40, window.mean(0));
+}
+
+void test_coverage_rounds_to_nearest_percent(void) {
+  TimeWeightedWindow<1> window;
+  window.begin(0, 1000);
+  add(window, 0, 1, 5); // 0.5 %
+  window.close();
+  TEST_ASSERT_EQUAL_INT(1, window.coverage(0));
+  window.begin(1000, 4000);
+  add(window, 1000, 1, 1000); // 33.3 %
+  window.close();
+  TEST_ASSERT_EQUAL_INT(33, window.coverage(0));
+}
+
+void test_reset_drops_held_samples(void) {
+  TimeWeightedWindow<2> window;
+  const int32_t         values[2] = { 7, 9 };
+  window.begin(0, 1000);
+  window.add(0, 0, values, 2, 5000);
+  window.reset(1, 1); // The second channel's sensor went offline
+  window.close();
+  TEST_ASSERT_EQUAL_UINT32(1000, window.covered(0));
+  TEST_ASSERT_EQUAL_UINT32(0, window.covered(1));
+  TEST_ASSERT_EQUAL_FLOAT(0, window.mean(1));
+}
+
+int main(void) {
+  UNITY_BEGIN();
+  RUN_TEST(test_weighted_by_hold_time);
+  RUN_TEST(test_gap_is_not_filled);
+  RUN_TEST(test_held_sample_carries_over);
+  RUN_TEST(test_sample_past_window_end);
+  RUN_TEST(test_coverage_rounds_to_nearest_percent);
+  RUN_TEST(test_reset_drops_held_samples);
+  return UNITY_END();
+}